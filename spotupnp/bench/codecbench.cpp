@@ -0,0 +1,511 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <mutex>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include "codecs.h"
+
+/****************************************************************************************
+ * Codec throughput benchmark. Every codec spec is created with createCodec(), fed the same
+ * PCM (synthetic or from a file) as fast as it takes it and drained into a sink, encoding
+ * runs inline as the codec is not shared with the encoder pool, except for flac:mt where
+ * wall time shows how frames encoding scales. Reports x-realtime factor on wall time,
+ * input/output rates on CPU time, peak RSS and number of heap allocations, and optionally
+ * writes all results in JSON so that releases can be compared
+ *
+ *	codecbench [-d seconds] [-i file.wav|file.raw] [-o results.json] [codec ...]
+ *	codecbench -r [-d seconds]
+ *	codecbench -s [-i file.wav|file.raw] [codec ...]
+ *
+ * codec is the same as the codec config key (pcm, wav, flac:5, mp3:320, opus:128 ...)
+ *
+ * With -r, it instead measures how fast bytes go through the encoded output ring from one
+ * thread to another, both for the mutex-protected ring it used to be and for byteBuffer,
+ * with 1 to 8 rings running at the same time as they all take segments from one pool
+ *
+ * With -s, it measures how long it takes from a track load to the first encoded byte when
+ * the encoder is opened on load (cold, streamer created then) and when it was opened ahead
+ * of time (warm, parked spare from the streamer pool)
+ */
+
+/****************************************************************************************
+ * Allocation counter
+ */
+
+static std::atomic<uint64_t> allocations = 0;
+
+#ifdef __GLIBC__
+extern "C" {
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+
+void* malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+}
+#else
+// only C++ allocations are visible, codec libraries' own malloc() are not counted
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
+/****************************************************************************************
+ * Helpers
+ */
+
+struct result {
+    std::string spec, id, mimeType;
+    double openMs = 0, startMs = 0, wallMs = 0, cpuMs = 0;
+    double realtime = 0, pcmRate = 0, encodedRate = 0, kbps = 0;
+    uint64_t pcmBytes = 0, encodedBytes = 0, allocations = 0;
+    long peakRss = 0;
+    bool failed = false;
+};
+
+static double cpuTime(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+static void resetPeakRss(void) {
+    // Linux lets us reset high-water mark, otherwise peak is for the whole process
+    if (FILE* file = fopen("/proc/self/clear_refs", "w")) {
+        fputs("5", file);
+        fclose(file);
+    }
+}
+
+static long peakRss(void) {
+    long peak = 0;
+    if (FILE* file = fopen("/proc/self/status", "r")) {
+        char line[128];
+        while (fgets(line, sizeof(line), file) && sscanf(line, "VmHWM: %ld", &peak) != 1);
+        fclose(file);
+    }
+    if (!peak) {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+    return peak;
+}
+
+static std::string cpuModel(void) {
+    std::string model = "unknown";
+    if (FILE* file = fopen("/proc/cpuinfo", "r")) {
+        char line[256];
+        while (fgets(line, sizeof(line), file)) {
+            if (strncmp(line, "model name", 10)) continue;
+            if (char* p = strchr(line, ':')) {
+                model = p + 2;
+                model.erase(model.find_last_not_of("\r\n") + 1);
+            }
+            break;
+        }
+        fclose(file);
+    }
+    return model;
+}
+
+/****************************************************************************************
+ * PCM sources (44.1kHz, 16 bits, stereo like what cspot decoder produces)
+ */
+
+static std::vector<uint8_t> synthetic(int seconds) {
+    // M_PI is not standard C++
+    const double pi = 3.14159265358979323846;
+    // a few tones and some noise so that encoders can't take shortcuts, always the same
+    size_t frames = 44100 * seconds;
+    std::vector<uint8_t> pcm(frames * 4);
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < frames; i++) {
+        double t = i / 44100.0;
+        double tones = 0.3 * sin(2 * pi * 440 * t) + 0.2 * sin(2 * pi * 1250 * t + 0.1 * sin(2 * pi * 3 * t)) +
+                       0.1 * sin(2 * pi * 7040 * t);
+        for (int c = 0; c < 2; c++) {
+            seed = seed * 1664525 + 1013904223;
+            double noise = ((int32_t) seed >> 16) / 32768.0 * 0.05;
+            int16_t sample = (int16_t) (32767 * (tones * (c ? 0.8 : 1.0) + noise));
+            memcpy(&pcm[i * 4 + c * 2], &sample, 2);
+        }
+    }
+    return pcm;
+}
+
+static std::vector<uint8_t> recorded(const char* name) {
+    FILE* file = fopen(name, "rb");
+    if (!file) throw std::runtime_error(std::string("can't open ") + name);
+
+    std::vector<uint8_t> pcm;
+    uint8_t buffer[16384];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0;) pcm.insert(pcm.end(), buffer, buffer + n);
+    fclose(file);
+
+    // skip WAV header by looking for data chunk (assume 44.1kHz/16/2), otherwise it's raw
+    if (pcm.size() > 12 && !memcmp(pcm.data(), "RIFF", 4) && !memcmp(pcm.data() + 8, "WAVE", 4)) {
+        for (size_t pos = 12; pos + 8 <= pcm.size();) {
+            uint32_t len = pcm[pos + 4] | pcm[pos + 5] << 8 | pcm[pos + 6] << 16 | (uint32_t) pcm[pos + 7] << 24;
+            if (!memcmp(&pcm[pos], "data", 4)) {
+                pcm = std::vector<uint8_t>(pcm.begin() + pos + 8, pcm.begin() + std::min(pcm.size(), pos + 8 + len));
+                break;
+            }
+            pos += 8 + len + (len & 1);
+        }
+    }
+
+    pcm.resize(pcm.size() & ~3);
+    if (pcm.empty()) throw std::runtime_error(std::string("no PCM in ") + name);
+    return pcm;
+}
+
+/****************************************************************************************
+ * Benchmark one codec
+ */
+
+static result run(const std::string& spec, const std::vector<uint8_t>& source, uint64_t total) {
+    result result;
+    result.spec = spec;
+    result.pcmBytes = total;
+
+    auto sink = std::make_unique<uint8_t[]>(65536);
+    auto clock = [] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count(); };
+
+    resetPeakRss();
+    uint64_t allocations = ::allocations.load();
+    double wall = clock(), cpu = cpuTime();
+
+    try {
+        // parallel codecs only use the pool when they are shared
+        std::unique_ptr<baseCodec> owned = createCodec(spec);
+        std::shared_ptr<baseCodec> shared;
+        if (spec.find(":mt") != std::string::npos) shared = std::move(owned);
+        baseCodec* codec = shared ? shared.get() : owned.get();
+        if (!codec->prepare()) throw std::runtime_error("can't open codec");
+        result.openMs = clock() - wall;
+        double start = clock();
+        codec->initialize(total * 1000 / (44100 * 4));
+        result.startMs = clock() - start;
+        result.id = codec->id();
+        result.mimeType = codec->mimeType;
+
+        // write as long as codec accepts it, then read until it accepts more
+        for (uint64_t fed = 0, stuck = 0; fed < total;) {
+            size_t offset = fed % source.size();
+            size_t chunk = std::min<uint64_t>({ 4096, source.size() - offset, total - fed });
+            if (codec->pcmWrite(source.data() + offset, chunk)) {
+                fed += chunk;
+                stuck = 0;
+            } else if (size_t bytes = codec->read(sink.get(), 65536)) {
+                result.encodedBytes += bytes;
+                stuck = 0;
+            } else if (++stuck > 1000) {
+                throw std::runtime_error("codec does not make progress");
+            } else if (shared) {
+                // wait for pool to finish a batch
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+
+        // read until codec has output its tail (done by the pool when shared)
+        for (uint64_t stuck = 0; !codec->isDrained();) {
+            if (size_t bytes = codec->read(sink.get(), 65536, 0, true)) {
+                result.encodedBytes += bytes;
+                stuck = 0;
+            } else if (++stuck > 1000) {
+                throw std::runtime_error("codec does not drain");
+            } else if (shared) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s: %s\n", spec.c_str(), e.what());
+        result.failed = true;
+    }
+
+    result.wallMs = clock() - wall;
+    result.cpuMs = cpuTime() - cpu;
+    result.allocations = ::allocations.load() - allocations;
+    result.peakRss = peakRss();
+
+    double audioMs = total * 1000.0 / (44100 * 4);
+    // real-time is what a listener gets (pool included), rates are per CPU
+    result.realtime = audioMs / std::max(result.wallMs, 0.001);
+    double ms = std::max(result.cpuMs, 0.001);
+    result.pcmRate = total * 1000.0 / ms;
+    result.encodedRate = result.encodedBytes * 1000.0 / ms;
+    result.kbps = result.encodedBytes * 8 / audioMs;
+    return result;
+}
+
+/****************************************************************************************
+ * Ring buffers throughput
+ */
+
+// byteBuffer as it was before it became a lock-free ring of memory pool segments
+class lockedRing {
+private:
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t size, readPos = 0, writePos = 0;
+    std::mutex mutex;
+
+    size_t _used(void) { return writePos >= readPos ? writePos - readPos : size - (readPos - writePos); }
+
+public:
+    lockedRing(FILE* storage = NULL, size_t size = 4 * 1024 * 1024) : buffer(new uint8_t[size]), size(size) { }
+
+    size_t read(uint8_t* dst, size_t max, size_t min = 0) {
+        std::scoped_lock lock(mutex);
+        max = std::min(max, _used());
+        if (max < min) return 0;
+        size_t cont = std::min(max, size - readPos);
+        memcpy(dst, buffer.get() + readPos, cont);
+        memcpy(dst + cont, buffer.get(), max - cont);
+        readPos = (readPos + max) % size;
+        return max;
+    }
+
+    bool write(const uint8_t* src, size_t len) {
+        std::scoped_lock lock(mutex);
+        if (len > size - _used() - 1) return false;
+        size_t cont = std::min(len, size - writePos);
+        memcpy(buffer.get() + writePos, src, cont);
+        memcpy(buffer.get(), src + cont, len - cont);
+        writePos = (writePos + len) % size;
+        return true;
+    }
+};
+
+template <class Ring>
+static double ringRate(int pairs, uint64_t total) {
+    // every producer writes chunks like an encoder does and its consumer reads like a connection
+    std::vector<std::unique_ptr<Ring>> rings;
+    for (int i = 0; i < pairs; i++) rings.emplace_back(std::make_unique<Ring>());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& ring : rings) {
+        threads.emplace_back([ring = ring.get(), total] {
+            uint8_t chunk[4096];
+            memset(chunk, 0x55, sizeof(chunk));
+            for (uint64_t fed = 0; fed < total;) {
+                if (ring->write(chunk, sizeof(chunk))) fed += sizeof(chunk);
+                else std::this_thread::yield();
+            }
+        });
+        threads.emplace_back([ring = ring.get(), total] {
+            uint8_t chunk[16384];
+            for (uint64_t got = 0; got < total;) {
+                if (size_t bytes = ring->read(chunk, sizeof(chunk))) got += bytes;
+                else std::this_thread::yield();
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return pairs * total / std::max(seconds, 1e-6) / (1024 * 1024);
+}
+
+static void rings(int seconds) {
+    // 4 MB per second of audio, which is way more than what any codec outputs
+    uint64_t total = (uint64_t) seconds * 4 * 1024 * 1024;
+    printf("%-8s %14s %14s %8s\n", "rings", "mutex(MB/s)", "lockfree(MB/s)", "gain");
+    for (int pairs = 1; pairs <= 8; pairs *= 2) {
+        double locked = ringRate<lockedRing>(pairs, total);
+        double lockFree = ringRate<byteBuffer>(pairs, total);
+        printf("%-8d %14.0f %14.0f %7.2fx\n", pairs, locked, lockFree, lockFree / std::max(locked, 1e-6));
+    }
+}
+
+/****************************************************************************************
+ * Track start latency
+ */
+
+static double firstByte(const std::string& spec, const std::vector<uint8_t>& source, bool warm) {
+    auto clock = [] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count(); };
+    auto sink = std::make_unique<uint8_t[]>(65536);
+    std::shared_ptr<baseCodec> codec;
+    double start = 0;
+
+    // this is what a spare streamer does on its own thread or what a new one does on load
+    if (!warm) start = clock();
+    codec = createCodec(spec);
+    if (!codec->prepare()) throw std::runtime_error("can't open codec");
+    if (warm) {
+        codec->park(true);
+        start = clock();
+        codec->park(false);
+    }
+
+    // then load sets the duration, PCM comes in and we wait for encoder's first output
+    codec->initialize(source.size() * 1000 / (44100 * 4));
+    for (size_t fed = 0, stuck = 0; ;) {
+        size_t chunk = std::min<size_t>(4096, source.size() - fed % source.size());
+        if (codec->read(sink.get(), 65536)) break;
+        if (codec->pcmWrite(source.data() + fed % source.size(), chunk)) {
+            fed += chunk;
+            stuck = 0;
+        } else if (++stuck > 1000) {
+            throw std::runtime_error("codec does not output anything");
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    return clock() - start;
+}
+
+static bool startup(const std::vector<std::string>& specs, const std::vector<uint8_t>& source) {
+    // median of a few loads, first one being also a warm-up of libraries
+    const int loads = 21;
+    bool failed = false;
+    printf("%-12s %10s %10s %10s\n", "codec", "cold(ms)", "warm(ms)", "saved(ms)");
+    for (auto& spec : specs) {
+        try {
+            std::vector<double> cold, warm;
+            for (int i = 0; i < loads; i++) {
+                cold.push_back(firstByte(spec, source, false));
+                warm.push_back(firstByte(spec, source, true));
+            }
+            std::sort(cold.begin(), cold.end());
+            std::sort(warm.begin(), warm.end());
+            printf("%-12s %10.2f %10.2f %10.2f\n", spec.c_str(), cold[loads / 2], warm[loads / 2], cold[loads / 2] - warm[loads / 2]);
+        } catch (std::exception& e) {
+            fprintf(stderr, "%s: %s\n", spec.c_str(), e.what());
+            failed = true;
+        }
+    }
+    return !failed;
+}
+
+/****************************************************************************************
+ * Main
+ */
+
+static void usage(const char* name) {
+    printf("%s [-d <seconds>] [-i <file>] [-o <json>] [codec ...]\n"
+           "%s -r [-d <seconds>]\n"
+           "%s -s [-i <file>] [codec ...]\n"
+           "  -d <seconds>\t length of audio to encode (default 60)\n"
+           "  -r\t\t measure encoded output ring throughput instead\n"
+           "  -s\t\t measure time from track load to first encoded byte instead\n"
+           "  -i <file>\t use PCM from a WAV or raw (44.1kHz, 16 bits, stereo) file, looped if needed\n"
+           "  -o <json>\t write results to <json>, '-' for stdout\n"
+           "  codec\t\t pcm, wav, flac[:0..8][:mt], opus[:bitrate], vorbis[:bitrate], aac[:bitrate], mp3[:bitrate]\n",
+           name, name, name);
+}
+
+int main(int argc, char* argv[]) {
+    const char *input = NULL, *output = NULL;
+    int seconds = 60;
+    bool ring = false, start = false;
+    std::vector<std::string> specs;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-d") && i + 1 < argc) seconds = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "-i") && i + 1 < argc) input = argv[++i];
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc) output = argv[++i];
+        else if (!strcmp(argv[i], "-r")) ring = true;
+        else if (!strcmp(argv[i], "-s")) start = true;
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else specs.push_back(argv[i]);
+    }
+
+    if (ring) {
+        rings(seconds);
+        return 0;
+    }
+
+    if (specs.empty()) {
+        specs = { "pcm", "wav" };
+        for (int level = 0; level <= 8; level++) specs.push_back("flac:" + std::to_string(level));
+        specs.insert(specs.end(), { "opus", "vorbis:160", "mp3:320", "aac:256" });
+    }
+
+    std::vector<uint8_t> source;
+    try {
+        source = input ? recorded(input) : synthetic(std::min(seconds, 10));
+    } catch (std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    uint64_t total = (uint64_t) seconds * 44100 * 4;
+
+    if (start) return startup(specs, source) ? 0 : 2;
+
+    printf("%-12s %10s %10s %10s %10s %8s %12s %12s %10s %8s\n", "codec", "open(ms)", "wall(ms)", "cpu(ms)", "x-realtime", "kbps",
+           "pcm(B/s)", "out(B/s)", "allocs", "rss(kB)");
+
+    std::vector<result> results;
+    for (auto& spec : specs) {
+        auto result = run(spec, source, total);
+        printf("%-12s %10.2f %10.1f %10.1f %10.1f %8.0f %12.0f %12.0f %10" PRIu64 " %8ld%s\n", spec.c_str(), result.openMs,
+               result.wallMs, result.cpuMs, result.realtime, result.kbps, result.pcmRate, result.encodedRate, result.allocations,
+               result.peakRss, result.failed ? " FAILED" : "");
+        results.push_back(result);
+    }
+
+    if (output) {
+        FILE* file = strcmp(output, "-") ? fopen(output, "w") : stdout;
+        if (!file) {
+            fprintf(stderr, "can't write %s\n", output);
+            return 1;
+        }
+        fprintf(file, "{\n  \"timestamp\": %lld,\n  \"cpu\": \"%s\",\n  \"threads\": %u,\n  \"input\": \"%s\",\n  \"seconds\": %d,\n  \"results\": [\n",
+                (long long) time(NULL), cpuModel().c_str(), std::thread::hardware_concurrency(), input ? input : "synthetic", seconds);
+        for (size_t i = 0; i < results.size(); i++) {
+            auto& r = results[i];
+            fprintf(file, "    { \"codec\": \"%s\", \"id\": \"%s\", \"mime\": \"%s\", \"failed\": %s, "
+                          "\"open_ms\": %.3f, \"start_ms\": %.3f, \"wall_ms\": %.1f, \"cpu_ms\": %.1f, \"realtime\": %.2f, "
+                          "\"pcm_bytes\": %" PRIu64 ", \"encoded_bytes\": %" PRIu64 ", \"pcm_bytes_per_s\": %.0f, "
+                          "\"encoded_bytes_per_s\": %.0f, \"kbps\": %.1f, \"allocations\": %" PRIu64 ", \"peak_rss_kb\": %ld }%s\n",
+                    r.spec.c_str(), r.id.c_str(), r.mimeType.c_str(), r.failed ? "true" : "false", r.openMs, r.startMs,
+                    r.wallMs, r.cpuMs, r.realtime, r.pcmBytes, r.encodedBytes, r.pcmRate, r.encodedRate, r.kbps,
+                    r.allocations, r.peakRss, i + 1 < results.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n}\n");
+        if (file != stdout) fclose(file);
+    }
+
+    bool failed = std::any_of(results.begin(), results.end(), [](auto& r) { return r.failed; });
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,97 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "sampleKernels.h"
+
+/****************************************************************************************
+ * Sample kernels microbenchmark. Runs every version this CPU supports on the same buffer
+ * (one second of stereo by default, what codecs see in a few calls), checks that result
+ * is identical to scalar version and prints throughput and speedup versus scalar
+ *
+ *	kernelbench [-n frames] [-r rounds]
+ */
+
+static double measure(int rounds, std::function<void()> kernel) {
+    // keep best round so that noise of other processes is not counted
+    double best = 1e30;
+    for (int i = 0; i < rounds; i++) {
+        auto start = std::chrono::steady_clock::now();
+        kernel();
+        best = std::min(best, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    size_t frames = 44100;
+    int rounds = 200;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) frames = std::max(atoi(argv[++i]), 1);
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc) rounds = std::max(atoi(argv[++i]), 1);
+        else {
+            printf("%s [-n <frames>] [-r <rounds>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // one more sample so that buffers are not vector-aligned, like in codecs' ring buffers
+    std::vector<int16_t> source(frames * 2 + 1);
+    uint32_t seed = 0x12345678;
+    for (auto& sample : source) sample = (int16_t) ((seed = seed * 1664525 + 1013904223) >> 16);
+    const int16_t* input = source.data() + 1;
+    size_t samples = frames * 2;
+
+    std::vector<uint16_t> swapped(samples);
+    std::vector<int32_t> widened(samples);
+    std::vector<float> left(frames), right(frames);
+    std::vector<uint16_t> swappedRef;
+    std::vector<int32_t> widenedRef;
+    std::vector<float> leftRef, rightRef;
+    double scalar[3] = { 0 };
+    bool failed = false;
+
+    printf("%zu frames, best of %d rounds\n", frames, rounds);
+    printf("%-8s %-14s %10s %10s %8s\n", "version", "kernel", "us", "MS/s", "speedup");
+
+    for (auto kernels : sampleKernels::available()) {
+        double us[3];
+        const char* names[] = { "byteswap16", "widen16", "deinterleave16" };
+
+        us[0] = measure(rounds, [&] {
+            memcpy(swapped.data(), input, samples * 2);
+            kernels->byteswap16(swapped.data(), samples);
+        });
+        us[1] = measure(rounds, [&] { kernels->widen16(input, widened.data(), samples); });
+        us[2] = measure(rounds, [&] { kernels->deinterleave16(input, left.data(), right.data(), frames, 1.0f / INT16_MAX); });
+
+        if (!strcmp(kernels->name, "scalar")) {
+            memcpy(scalar, us, sizeof(us));
+            swappedRef = swapped;
+            widenedRef = widened;
+            leftRef = left;
+            rightRef = right;
+        }
+
+        bool ok = swapped == swappedRef && widened == widenedRef && left == leftRef && right == rightRef;
+        failed |= !ok;
+
+        for (int i = 0; i < 3; i++) {
+            printf("%-8s %-14s %10.1f %10.1f %7.2fx%s\n", kernels->name, names[i], us[i], samples / us[i], scalar[i] / us[i],
+                   ok ? "" : " MISMATCH");
+        }
+    }
+
+    printf("selected: %s\n", sampleKernels::get().name);
+    return failed ? 2 : 0;
+}
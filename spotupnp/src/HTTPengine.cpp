@@ -0,0 +1,265 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#else
+#include <ws2tcpip.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "Logger.h"
+
+#include "HTTPengine.h"
+
+#ifndef _WIN32
+#define closesocket(s) close(s)
+#else
+#define poll WSAPoll
+#endif
+
+static uint64_t nowMs(void) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/****************************************************************************************
+ * Readiness-driven engine for all HTTP sockets
+ */
+
+HTTPengine::HTTPengine(void) : bell::Task("HTTP engine", 32 * 1024, 0, 0) {
+#ifdef __linux__
+    pollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event event = { };
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(pollFd, EPOLL_CTL_ADD, wakeFd, &event);
+#else
+    // a UDP socket connected to itself is the only portable (incl. Windows) self-pipe
+    struct sockaddr_in addr = { };
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    wakeFd = socket(AF_INET, SOCK_DGRAM, 0);
+    bind(wakeFd, (struct sockaddr*) &addr, sizeof(addr));
+    getsockname(wakeFd, (struct sockaddr*) &addr, &len);
+    ::connect(wakeFd, (struct sockaddr*) &addr, sizeof(addr));
+    setNonBlocking(wakeFd);
+#endif
+#ifdef __linux__
+    if (pollFd < 0) throw std::runtime_error("can't create HTTP engine");
+#endif
+    if (wakeFd < 0) throw std::runtime_error("can't create HTTP engine");
+}
+
+HTTPengine* HTTPengine::instance(void) {
+    static HTTPengine* engine = [] {
+        auto engine = new HTTPengine();
+        engine->startTask();
+        return engine;
+    }();
+    return engine;
+}
+
+void HTTPengine::setNonBlocking(int sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(sock, FIONBIO, &mode);
+#else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+bool HTTPengine::wouldBlock(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+void HTTPengine::control(int sock, uint32_t events, bool add) {
+#ifdef __linux__
+    struct epoll_event event = { };
+    event.data.fd = sock;
+    if (events & READ) event.events |= EPOLLIN | EPOLLRDHUP;
+    if (events & WRITE) event.events |= EPOLLOUT;
+    epoll_ctl(pollFd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, sock, &event);
+#else
+    // poll set is rebuilt at every loop so we just need to get out of current poll()
+    if (std::this_thread::get_id() != loopId) wake();
+#endif
+}
+
+void HTTPengine::add(int sock, uint32_t events, eventHandler handler) {
+    std::scoped_lock lock(mutex);
+    entries[sock] = { handler, events };
+    control(sock, events, true);
+}
+
+void HTTPengine::modify(int sock, uint32_t events) {
+    std::scoped_lock lock(mutex);
+    auto it = entries.find(sock);
+    if (it == entries.end() || it->second.events == events) return;
+    it->second.events = events;
+    control(sock, events, false);
+}
+
+void HTTPengine::remove(int sock) {
+    // this waits for the handler to return if it is running
+    std::scoped_lock lock(mutex);
+    if (!entries.erase(sock)) return;
+#ifdef __linux__
+    epoll_ctl(pollFd, EPOLL_CTL_DEL, sock, NULL);
+#else
+    if (std::this_thread::get_id() != loopId) wake();
+#endif
+}
+
+void HTTPengine::timer(int sock, int32_t ms) {
+    std::scoped_lock lock(mutex);
+    auto it = entries.find(sock);
+    if (it == entries.end()) return;
+    // negative delay means cancel
+    it->second.deadline = ms >= 0 ? nowMs() + ms : 0;
+    if (std::this_thread::get_id() != loopId) wake();
+}
+
+void HTTPengine::post(std::function<void()> job) {
+    std::scoped_lock lock(postMutex);
+    posted.push_back(job);
+    if (std::this_thread::get_id() != loopId) wake();
+}
+
+void HTTPengine::wake(void) {
+#ifdef __linux__
+    uint64_t one = 1;
+    (void) !write(wakeFd, &one, sizeof(one));
+#else
+    send(wakeFd, "", 1, 0);
+#endif
+}
+
+void HTTPengine::dispatch(int sock, uint32_t events) {
+    std::scoped_lock lock(mutex);
+    auto it = entries.find(sock);
+    if (it == entries.end()) return;
+
+    // errors are reported as READ so that handler finds out when receiving
+    if (!(events & TIMER)) events &= it->second.events | READ;
+    if (!events) return;
+
+    // handler might remove itself, so make a copy
+    auto handler = it->second.handler;
+    handler(sock, events);
+}
+
+void HTTPengine::runTask() {
+    loopId = std::this_thread::get_id();
+    isRunning = true;
+
+    std::vector<int> expired;
+#ifndef __linux__
+    std::vector<struct pollfd> fds;
+#endif
+
+    while (isRunning) {
+        int timeout = -1;
+
+        {
+            std::scoped_lock lock(mutex);
+            uint64_t now = nowMs();
+
+            for (auto& [sock, entry] : entries) {
+                if (!entry.deadline) continue;
+                int delay = entry.deadline > now ? entry.deadline - now : 0;
+                if (timeout < 0 || delay < timeout) timeout = delay;
+            }
+
+#ifndef __linux__
+            fds.clear();
+            fds.push_back({ (decltype(pollfd::fd)) wakeFd, POLLIN, 0 });
+            for (auto& [sock, entry] : entries) {
+                short events = (entry.events & READ ? POLLIN : 0) | (entry.events & WRITE ? POLLOUT : 0);
+                fds.push_back({ (decltype(pollfd::fd)) sock, events, 0 });
+            }
+#endif
+        }
+
+#ifdef __linux__
+        struct epoll_event events[32];
+        int n = epoll_wait(pollFd, events, sizeof(events) / sizeof(*events), timeout);
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == wakeFd) {
+                uint64_t count;
+                (void) !read(wakeFd, &count, sizeof(count));
+                continue;
+            }
+
+            uint32_t flags = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) ? READ : NONE;
+            if (events[i].events & EPOLLOUT) flags |= WRITE;
+            dispatch(events[i].data.fd, flags);
+        }
+#else
+        int n = poll(fds.data(), fds.size(), timeout);
+
+        for (size_t i = 0; n > 0 && i < fds.size(); i++) {
+            if (!fds[i].revents) continue;
+
+            if (fds[i].fd == wakeFd) {
+                char buffer[64];
+                while (recv(wakeFd, buffer, sizeof(buffer), 0) > 0);
+                continue;
+            }
+
+            uint32_t flags = fds[i].revents & (POLLIN | POLLHUP | POLLERR) ? READ : NONE;
+            if (fds[i].revents & POLLOUT) flags |= WRITE;
+            dispatch(fds[i].fd, flags);
+        }
+#endif
+
+        // expired timers (they are one-shot)
+        expired.clear();
+        {
+            std::scoped_lock lock(mutex);
+            uint64_t now = nowMs();
+            for (auto& [sock, entry] : entries) {
+                if (!entry.deadline || entry.deadline > now) continue;
+                entry.deadline = 0;
+                expired.push_back(sock);
+            }
+        }
+        for (auto sock : expired) dispatch(sock, TIMER);
+
+        // run posted jobs without any lock held
+        while (true) {
+            std::function<void()> job;
+            {
+                std::scoped_lock lock(postMutex);
+                if (posted.empty()) break;
+                job = std::move(posted.front());
+                posted.pop_front();
+            }
+            job();
+        }
+    }
+}
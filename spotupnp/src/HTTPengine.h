@@ -0,0 +1,66 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <inttypes.h>
+
+#include "BellTask.h"
+#ifdef _WIN32
+#include "win32shim.h"
+#endif
+
+/****************************************************************************************
+ * One readiness-driven loop (epoll on Linux, poll elsewhere) that owns all HTTP sockets
+ * so that we don't need one thread per streamer. Each socket has a handler called with
+ * the events it subscribed to, and can arm a one-shot timer. Handlers run with engine's
+ * (recursive) mutex held, so once remove() returns the handler is not running and will
+ * never be called again. Handlers can add/modify/remove sockets but must not block on
+ * any other lock: use post() to run something outside the engine's context.
+ */
+class HTTPengine : public bell::Task {
+public:
+    enum { NONE = 0, READ = 0x01, WRITE = 0x02, TIMER = 0x04 };
+    typedef std::function<void(int sock, uint32_t events)> eventHandler;
+
+private:
+    struct entry {
+        eventHandler handler;
+        uint32_t events;
+        uint64_t deadline = 0;
+    };
+
+    std::atomic<bool> isRunning = false;
+    std::thread::id loopId;
+    std::recursive_mutex mutex;
+    std::mutex postMutex;
+    std::map<int, entry> entries;
+    std::deque<std::function<void()>> posted;
+    int pollFd = -1, wakeFd = -1;
+
+    HTTPengine(void);
+    void runTask();
+    void dispatch(int sock, uint32_t events);
+    void control(int sock, uint32_t events, bool add);
+
+public:
+    static HTTPengine* instance(void);
+    static void setNonBlocking(int sock);
+    static bool wouldBlock(void);
+
+    void add(int sock, uint32_t events, eventHandler handler);
+    void modify(int sock, uint32_t events);
+    void remove(int sock);
+    void timer(int sock, int32_t ms);
+    void post(std::function<void()> job);
+    void wake(void);
+};
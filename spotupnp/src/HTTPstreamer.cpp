@@ -7,15 +7,24 @@
 #include <memory>
 #include <vector>
 #include <inttypes.h>
-#include <sstream>
-#include <regex>
+#include <cstdarg>
 #include <algorithm>
 #include <atomic>
 #include <string>
 #ifndef _WIN32
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/types.h>
+#include <sys/uio.h>
+#endif
 #else
 #include <ws2tcpip.h>
 #endif
@@ -27,159 +36,361 @@
 #ifndef _WIN32
 #include <unistd.h>
 #define closesocket(s) close(s)
+#else
+#define SHUT_RDWR SD_BOTH
 #endif
 
 /****************************************************************************************
  * Ring buffer (always rolls over)
  */
 
-ringBuffer::ringBuffer(size_t size) : cacheBuffer(size) {
-    buffer = new uint8_t[size];
-    this->write_p = this->read_p = buffer;
-    this->wrap = buffer + size;
+ringBuffer::ringBuffer(size_t maxSize) : cacheBuffer(0), maxSize(maxSize) {
+    memoryPool::instance().join();
 }
 
-ssize_t ringBuffer::scope(size_t offset) {
-    if (offset >= total) return offset - total + 1;
-    else if (offset >= total - level()) return 0;
-    else return offset - total + level();
+ringBuffer::~ringBuffer(void) {
+    release();
+    if (!parked) memoryPool::instance().leave();
 }
 
-void ringBuffer::setOffset(size_t offset) {
-    if (offset >= total) read_p = write_p;
-    else if (offset < total - level()) read_p = (write_p + 1) == wrap ? buffer : write_p + 1;
-    else read_p = buffer + offset % size;
+void ringBuffer::park(bool parked) {
+    if (parked == this->parked) return;
+    this->parked = parked;
+    if (parked) memoryPool::instance().leave();
+    else memoryPool::instance().join();
 }
 
-size_t ringBuffer::read(uint8_t* dst, size_t size, size_t min) {
-    size = std::min(size, pending());
-    if (size < min) return 0;
+void ringBuffer::release(void) {
+    for (auto segment : segments) memoryPool::instance().release(segment);
+    segments.clear();
+    size = phase = 0;
+    wrapped = false;
+}
 
-    size_t cont = std::min(size, (size_t) (wrap - read_p));
-    memcpy(dst, read_p, cont);
-    memcpy(dst + cont, buffer, size - cont);
+void ringBuffer::trim(void) {
+    size_t target = allowed() / memoryPool::segmentSize;
+    if (target >= segments.size()) return;
+
+    // write position is the ring's start, so the first segments hold the oldest data and
+    // as capacity() already shrunk, producer has waited for readers to be done with them
+    size_t count = segments.size() - target;
+    for (size_t i = 0; i < count; i++) memoryPool::instance().release(segments[i]);
+    segments.erase(segments.begin(), segments.begin() + count);
+    size = target * memoryPool::segmentSize;
+    phase = total % size;
+    CSPOT_LOG(debug, "ring buffer trimmed by %zu segment(s) to %zu bytes", count, size);
+}
 
-    read_p += size;
-    if (read_p >= wrap) read_p -= this->size;
-    return size;
+ssize_t ringBuffer::scope(size_t offset) {
+    if (offset >= total) return offset - total + 1;
+    else if (offset >= total - level()) return 0;
+    else return offset - total + level();
 }
 
-uint8_t* ringBuffer::readInner(size_t& size) {
-    // caller *must* consume ALL data
-    size = std::min(size, pending());
-    size = std::min(size, (size_t)(wrap - read_p));
+size_t ringBuffer::read(size_t& offset, uint8_t* dst, size_t size) {
+    // reader has been overrun, resume from oldest data we have
+    if (offset < oldest()) offset = oldest();
+
+    size = std::min(size, total - offset);
 
-    uint8_t* p = read_p;
+    for (size_t done = 0; done < size;) {
+        size_t pos = (offset + done + this->size - phase) % this->size;
+        size_t cont = std::min(size - done, memoryPool::segmentSize - pos % memoryPool::segmentSize);
+        memcpy(dst + done, segments[pos / memoryPool::segmentSize] + pos % memoryPool::segmentSize, cont);
+        done += cont;
+    }
 
-    read_p += size;
-    if (read_p >= wrap) read_p -= this->size;
-    return size ? p : NULL;
+    offset += size;
+    return size;
 }
 
 void ringBuffer::write(const uint8_t* src, size_t size) {
-    size_t cont = std::min(size, (size_t)(wrap - write_p));
-    memcpy(write_p, src, cont);
-    memcpy(buffer, src + cont, size - cont);
-
-    write_p += size;
-    total += size;
+    for (size_t done = 0; done < size;) {
+        // data position depends on size, so we can only grow until we roll over
+        if (total == this->size && !wrapped) {
+            if (this->size + memoryPool::segmentSize <= std::min(maxSize, memoryPool::instance().share())) {
+                segments.push_back(memoryPool::instance().acquire());
+                this->size += memoryPool::segmentSize;
+            } else {
+                wrapped = true;
+            }
+        }
 
-    if (write_p >= wrap) write_p -= this->size;   
-    if (level() == this->size - 1) read_p = (write_p + 1 == wrap) ? buffer : write_p + 1;
+        size_t pos = (total + this->size - phase) % this->size;
+        // more buffers share the memory budget now, so give back what we don't own anymore
+        if (wrapped && !pos && this->size > memoryPool::segmentSize) {
+            trim();
+            pos = 0;
+        }
+        size_t cont = std::min(size - done, memoryPool::segmentSize - pos % memoryPool::segmentSize);
+        memcpy(segments[pos / memoryPool::segmentSize] + pos % memoryPool::segmentSize, src + done, cont);
+        total += cont;
+        done += cont;
+    }
 }
 
 /****************************************************************************************
  * File buffer
  */
 
-size_t fileBuffer::read(uint8_t* dst, size_t size, size_t min) {
-    size = std::min(size, total);
-    if (size < min) return 0;
-   
-    fseek(file, readOffset, SEEK_SET);
-    size_t bytes = fread(dst, 1, size, file);
-    readOffset += bytes;
+fileBuffer::fileBuffer(void) : cacheBuffer(0) {
+    // tmpfile() is deleted automatically, even if we crash
+    file = tmpfile();
+    if (!file) throw std::runtime_error("can't create cache file");
+#ifndef _WIN32
+    fd = fileno(file);
+    if (!grow(1024 * 1024)) throw std::runtime_error("can't map cache file");
+#endif
+}
 
-    return bytes;
+fileBuffer::fileBuffer(const std::string& path) : cacheBuffer(0), readOnly(true) {
+    file = fopen(path.c_str(), "rb");
+    if (!file) throw std::runtime_error("can't open cache file");
+    fseek(file, 0, SEEK_END);
+    total = ftell(file);
+#ifndef _WIN32
+    fd = fileno(file);
+    if (!total) return;
+    void* mapping = mmap(NULL, total, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        fclose(file);
+        throw std::runtime_error("can't map cache file");
+    }
+    buffer = (uint8_t*) mapping;
+    size = total;
+#endif
+}
+
+fileBuffer::~fileBuffer(void) {
+#ifndef _WIN32
+    if (buffer) munmap(buffer, size);
+#endif
+    fclose(file);
 }
 
-uint8_t* fileBuffer::readInner(size_t& size) {
-    if (size > this->size) {
-        delete[] buffer;
-        buffer = new uint8_t[size];
-        this->size = size;
+#ifndef _WIN32
+bool fileBuffer::grow(size_t size) {
+    // grow by doubling so that remapping stays rare
+    size_t capacity = std::max(this->size, (size_t) 1024 * 1024);
+    while (capacity < size) capacity *= 2;
+    if (ftruncate(fd, capacity) < 0) return false;
+
+#ifdef __linux__
+    void* mapping = buffer ? mremap(buffer, this->size, capacity, MREMAP_MAYMOVE) :
+                             mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#else
+    if (buffer) munmap(buffer, this->size);
+    void* mapping = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+
+    if (mapping == MAP_FAILED) {
+        CSPOT_LOG(error, "can't map %zu bytes of cache (%s)", capacity, strerror(errno));
+        // mremap leaves old mapping untouched
+#ifndef __linux__
+        buffer = NULL;
+        this->size = 0;
+#endif
+        return false;
     }
 
-    // caller *must* consume ALL data
-    size = std::min(size, total);
+    buffer = (uint8_t*) mapping;
+    this->size = capacity;
+    return true;
+}
+#endif
 
-    fseek(file, readOffset, SEEK_SET);
-    size = fread(buffer, 1, size, file);
-    readOffset += size;
+size_t fileBuffer::read(size_t& offset, uint8_t* dst, size_t size) {
+    size = std::min(size, total - std::min(offset, total));
+    if (!size) return 0;
+
+#ifndef _WIN32
+    memcpy(dst, buffer + offset, size);
+#else
+    fseek(file, offset, SEEK_SET);
+    size = fread(dst, 1, size, file);
+#endif
+    offset += size;
 
-    return size ? buffer : NULL;
+    return size;
 }
 
 void fileBuffer::write(const uint8_t* src, size_t size) {
+    if (readOnly) return;
+#ifndef _WIN32
+    // mapping is shared with the file so sendTo() sees the data as well
+    if (total + size > this->size && !grow(total + size)) return;
+    memcpy(buffer + total, src, size);
+#else
     fseek(file, 0, SEEK_END);
     fwrite(src, 1, size, file);
+    fflush(file);
+#endif
     total += size;
 }
 
+ssize_t fileBuffer::sendTo(int sock, size_t& offset, size_t max) {
+    size_t size = std::min(max, total - std::min(offset, total));
+    if (!size) return 0;
+
+#if defined(__linux__)
+    off_t start = offset;
+    ssize_t sent = sendfile(sock, fd, &start, size);
+#elif defined(__APPLE__)
+    off_t len = size;
+    ssize_t sent = sendfile(fd, sock, offset, &len, NULL, 0);
+    // partial sends are reported with EAGAIN
+    if (sent == 0 || len) sent = len;
+#elif defined(__FreeBSD__)
+    off_t len = 0;
+    ssize_t sent = sendfile(fd, sock, offset, size, NULL, &len, 0);
+    if (sent == 0 || len) sent = len;
+#else
+    errno = ENOSYS;
+    ssize_t sent = -1;
+#endif
+
+    if (sent > 0) offset += sent;
+    return sent;
+}
+
 /****************************************************************************************
- * Class to stream audio content with HTTP
+ * HTTP request parser and response writer
  */
 
-HTTPstreamer::HTTPstreamer(struct in_addr addr, std::string id, unsigned index, std::string codec, 
-                           bool flow, int64_t contentLength, int cacheMode, 
-                           cspot::TrackInfo trackInfo, std::string_view trackUnique, int32_t startOffset,
-                           onHeadersHandler onHeaders, EoSCallback onEoS) :
-                           trackUnique(trackUnique), flow(flow), trackInfo(trackInfo), cacheMode(cacheMode), 
-                           bell::Task("HTTP streamer", 32 * 1024, 0, 0) {
-    this->streamId = id + "_" + std::to_string(index);
-    this->listenSock = socket(AF_INET, SOCK_STREAM, 0);
-    this->host = std::string(inet_ntoa(addr));
-    this->onHeaders = onHeaders;
-    this->onEoS = onEoS;
-    this->icy.interval = 0;
-    // for flow mode, start with a negative offset so that we can always substract
-    this->offset = startOffset;
-    if (cacheMode == HTTP_CACHE_DISK && !flow) this->cache = std::make_unique<fileBuffer>();
-    else this->cache = std::make_unique<ringBuffer>();
+bool HTTPrequest::contains(std::string_view haystack, std::string_view needle) {
+    if (needle.size() > haystack.size()) return false;
+    for (size_t i = 0; i <= haystack.size() - needle.size(); i++) {
+        if (!strncasecmp(haystack.data() + i, needle.data(), needle.size())) return true;
+    }
+    return false;
+}
 
-    codecSettings settings;
-
-    if (codec.find("pcm") != std::string::npos) {
-        encoder = createCodec(codecSettings::PCM, settings);
-    } else if (codec.find("wav") != std::string::npos) {
-        encoder = createCodec(codecSettings::WAV, settings);
-    } else if (codec.find("flac") != std::string::npos || codec.find("flc") != std::string::npos) {
-        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.flac.level);
-        encoder = createCodec(codecSettings::FLAC, settings);
-    } else if (codec.find("opus") != std::string::npos) {
-        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.opus.bitrate);
-        encoder = createCodec(codecSettings::OPUS, settings);
-    } else if (codec.find("vorbis") != std::string::npos) {
-        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.vorbis.bitrate);
-        encoder = createCodec(codecSettings::VORBIS, settings);
-    } else if (codec.find("aac") != std::string::npos) {
-        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.aac.bitrate);
-        encoder = createCodec(codecSettings::AAC, settings);
-    } else if (codec.find("mp3") != std::string::npos) {
-        (void) !sscanf(codec.c_str(), "%*[^:]:%d", &settings.mp3.bitrate);
-        encoder = createCodec(codecSettings::MP3, settings);
-    } else throw std::runtime_error("unknown codec");
+bool HTTPrequest::parse(const uint8_t* data, size_t size) {
+    auto view = std::string_view((const char*) data, size);
+    auto trim = [](std::string_view s) {
+        while (!s.empty() && isspace((unsigned char) s.front())) s.remove_prefix(1);
+        while (!s.empty() && isspace((unsigned char) s.back())) s.remove_suffix(1);
+        return s;
+    };
 
-    // now estimate the content-length
-    setContentLength(contentLength);
+    for (size_t offset = 0, count = 0; offset < view.size(); count++) {
+        size_t eol = view.find_first_of("\r\n", offset);
+        if (eol == std::string_view::npos) return false;
+
+        auto current = view.substr(offset, eol - offset);
+        offset = eol + (view.compare(eol, 2, "\r\n") ? 1 : 2);
+
+        // request line is "method target version"
+        if (!count) {
+            size_t first = current.find(' '), last = current.rfind(' ');
+            if (first == std::string_view::npos || first == last) return false;
+            line = current;
+            method = current.substr(0, first);
+            target = current.substr(first + 1, last - first - 1);
+            version = current.substr(last + 1);
+            continue;
+        }
 
-    scratchLen = flow ? encoder->icyInterval : 16384;
-    scratch = new uint8_t[scratchLen];
-  
+        // empty line terminates headers
+        if (current.empty()) return true;
+
+        size_t colon = current.find(':');
+        if (colon == std::string_view::npos) continue;
+
+        auto name = trim(current.substr(0, colon));
+        for (int i = 0; i < MAX_HEADERS; i++) {
+            if (name.size() != strlen(names[i]) || strncasecmp(name.data(), names[i], name.size())) continue;
+            // view is never null here, even if empty, so presence can be tested
+            headers[i] = trim(current.substr(colon + 1));
+            break;
+        }
+    }
+
+    return false;
+}
+
+bool HTTPrequest::npt(std::string_view value, uint32_t& ms) {
+    char buffer[64];
+    double h, m, seconds, total;
+
+    // we only care about start time that is "npt=<sec>[.<frac>]" or "npt=<h>:<mm>:<ss>[.<frac>]"
+    if (value.size() >= sizeof(buffer) || !contains(value.substr(0, 4), "npt=")) return false;
+    memcpy(buffer, value.data() + 4, value.size() - 4);
+    buffer[value.size() - 4] = '\0';
+
+    // compute in double, as negative or too large values can't be converted to uint32_t
+    int count = sscanf(buffer, "%lf:%lf:%lf", &h, &m, &seconds);
+    if (count == 3 && h >= 0 && m >= 0 && seconds >= 0) total = (h * 3600 + m * 60 + seconds) * 1000;
+    else if (count == 1 || count == 2) total = h * 1000;
+    else return false;
+
+    // NaN fails both tests
+    if (!(total >= 0 && total <= UINT32_MAX)) return false;
+    ms = total;
+    return true;
+}
+
+size_t HTTPrequest::length(const uint8_t* data, size_t size) {
+    // like parse(), accept LF alone as end of line, so headers end with "\n\n" or "\n\r\n"
+    auto view = std::string_view((const char*) data, size);
+    size_t lf = view.find("\n\n"), crlf = view.find("\n\r\n");
+    if (lf == std::string_view::npos && crlf == std::string_view::npos) return 0;
+    return lf < crlf ? lf + 2 : crlf + 3;
+}
+
+bool HTTPrequest::keepAlive(void) {
+    // HTTP/1.1 is persistent by default, HTTP/1.0 must ask for it
+    if (version == "HTTP/1.1") return !contains(headers[CONNECTION], "close");
+    return contains(headers[CONNECTION], "keep-alive");
+}
+
+/****************************************************************************************
+ * Time index
+ */
+
+bool timeIndex::find(uint32_t ms, uint64_t& offset) {
+    // last entry that is not after requested time
+    auto it = std::upper_bound(entries.begin(), entries.end(), ms, [](uint32_t ms, const auto& entry) {
+        return ms < entry.first;
+    });
+
+    // beginning of stream is always at offset 0
+    if (it == entries.begin()) offset = 0;
+    else offset = (--it)->second;
+
+    // can't be more than 2 seconds ahead of what we have
+    return entries.size() && ms <= entries.back().first + 2000;
+}
+
+void HTTPresponse::add(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer + length, sizeof(buffer) - length, format, args);
+    va_end(args);
+    if (len > 0) length = std::min(length + len, sizeof(buffer) - 1);
+}
+
+void HTTPresponse::header(const char* name, const char* format, ...) {
+    add("%s: ", name);
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer + length, sizeof(buffer) - length, format, args);
+    va_end(args);
+    if (len > 0) length = std::min(length + len, sizeof(buffer) - 1);
+    add("\r\n");
+}
+
+/****************************************************************************************
+ * Shared HTTP server
+ */
+
+HTTPserver::HTTPserver(struct in_addr addr) {
     struct sockaddr_in host;
     host.sin_addr = addr;
     host.sin_family = AF_INET;
 
+    listenSock = socket(AF_INET, SOCK_STREAM, 0);
+
     for (int count = 0, offset = rand();; count++, offset++) {
         host.sin_port = htons(portBase + (offset % portRange));
         if (!bind(listenSock, (const sockaddr*) &host, sizeof(host))) break;
@@ -191,24 +402,207 @@ HTTPstreamer::HTTPstreamer(struct in_addr addr, std::string id, unsigned index,
     this->port = ntohs(host.sin_port);
     CSPOT_LOG(info, "Bound to port %u", this->port);
 
-    this->streamUrl = "http://" + this->host + ":" + std::to_string(this->port) + HTTP_BASE_URL + "." + this->encoder->id() + "?id=" + this->streamId;
-
-    if (::listen(listenSock, 1) < 0) {
+    if (::listen(listenSock, 16) < 0) {
         throw std::runtime_error("listen failed on port " +
             std::to_string(this->port) + ": " +
             std::string(strerror(errno)));
     }
+
+    HTTPengine::setNonBlocking(listenSock);
+    HTTPengine::instance()->add(listenSock, HTTPengine::READ, [this](int sock, uint32_t events) {
+        onAccept(sock, events);
+    });
+}
+
+std::shared_ptr<HTTPserver> HTTPserver::get(struct in_addr addr) {
+    static std::mutex mutex;
+    static std::map<uint32_t, std::shared_ptr<HTTPserver>> servers;
+
+    // servers are never deleted, there is one per interface
+    std::scoped_lock lock(mutex);
+    auto& server = servers[addr.s_addr];
+    if (!server) server = std::make_shared<HTTPserver>(addr);
+    return server;
+}
+
+void HTTPserver::attach(std::string id, std::weak_ptr<HTTPstreamer> streamer) {
+    std::scoped_lock lock(mutex);
+    streamers[id] = streamer;
+}
+
+void HTTPserver::detach(std::string id) {
+    std::scoped_lock lock(mutex);
+    streamers.erase(id);
+}
+
+void HTTPserver::reject(int sock, const char* status) {
+    char response[128];
+    int len = snprintf(response, sizeof(response), "HTTP/1.0 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+
+    // best effort, socket is brand new so it will accept that small response
+    (void) !send(sock, response, len, 0);
+    HTTPengine::instance()->remove(sock);
+    closesocket(sock);
+    incoming.erase(sock);
+}
+
+void HTTPserver::metricsReply(int sock) {
+    auto body = metrics::render();
+    HTTPresponse response;
+    response.status("HTTP/1.0", "200 OK");
+    response.header("Content-Type", "text/plain; version=0.0.4");
+    response.header("Content-Length", "%zu", body.size());
+    response.header("Connection", "close");
+    response.end();
+
+    // best effort as well, socket is brand new and metrics are a few kB at most
+    (void) !send(sock, response.data(), response.size(), 0);
+    (void) !send(sock, body.data(), body.size(), 0);
+    HTTPengine::instance()->remove(sock);
+    closesocket(sock);
+    incoming.erase(sock);
+}
+
+void HTTPserver::onAccept(int listenSock, uint32_t events) {
+    int sock;
+
+    while ((sock = accept(listenSock, NULL, NULL)) >= 0) {
+        CSPOT_LOG(info, "got HTTP connection %u", sock);
+        HTTPengine::setNonBlocking(sock);
+
+        std::scoped_lock lock(mutex);
+        incoming[sock].clear();
+        HTTPengine::instance()->add(sock, HTTPengine::READ, [this](int sock, uint32_t events) {
+            onRequest(sock, events);
+        });
+        // don't let idle connections sit there forever
+        HTTPengine::instance()->timer(sock, 5000);
+    }
+}
+
+void HTTPserver::onRequest(int sock, uint32_t events) {
+    std::unique_lock lock(mutex);
+    auto& data = incoming[sock];
+
+    if (events & HTTPengine::TIMER) {
+        CSPOT_LOG(info, "HTTP timeout on %d", sock);
+        return reject(sock, "408 Request Timeout");
+    }
+
+    // get the HTTP headers by chunks (there should be no body)
+    uint8_t buffer[256];
+    ssize_t n = recv(sock, (char*) buffer, sizeof(buffer), 0);
+
+    if (n == 0 || (n < 0 && !HTTPengine::wouldBlock())) {
+        HTTPengine::instance()->remove(sock);
+        closesocket(sock);
+        incoming.erase(sock);
+        return;
+    }
+
+    if (n > 0) data.insert(data.end(), buffer, buffer + n);
+    if (data.size() > 8192) return reject(sock, "431 Request Header Fields Too Large");
+    if (!HTTPrequest::length(data.data(), data.size())) return;
+
+    // extract streamId from request line
+    auto eol = std::find(data.begin(), data.end(), '\r');
+    auto line = std::string(data.begin(), eol);
+    size_t pos = line.find("?id=");
+    std::shared_ptr<HTTPstreamer> streamer;
+
+    if (line.starts_with("GET /metrics ")) return metricsReply(sock);
+
+    if (pos != std::string::npos) {
+        auto id = line.substr(pos + 4, line.find_first_of(" &", pos + 4) - pos - 4);
+        if (auto it = streamers.find(id); it != streamers.end()) streamer = it->second.lock();
+    }
+
+    if (!streamer) {
+        CSPOT_LOG(info, "no streamer for request %s", line.c_str());
+        return reject(sock, "404 Not Found");
+    }
+
+    // hand over the socket and what we have received so far to the streamer
+    auto request = std::move(data);
+    incoming.erase(sock);
+    HTTPengine::instance()->remove(sock);
+    lock.unlock();
+
+    streamer->accept(sock, request);
+}
+
+/****************************************************************************************
+ * Class to stream audio content with HTTP
+ */
+
+HTTPstreamer::HTTPstreamer(struct in_addr addr, std::string id, std::string codec, 
+                           bool flow, int64_t contentLength, int cacheMode, 
+                           onHeadersHandler onHeaders, EoSCallback onEoS) :
+                           flow(flow), cacheMode(cacheMode), id(id) {
+    this->host = std::string(inet_ntoa(addr));
+    this->onHeaders = onHeaders;
+    this->onEoS = onEoS;
+    this->lengthMode = contentLength;
+    if (cacheMode == HTTP_CACHE_DISK && !flow) this->cache = std::make_unique<fileBuffer>();
+    else this->cache = std::make_unique<ringBuffer>();
+
+    // encoder is opened now, only what depends on the track is left to load()
+    this->codec = codec;
+    encoder = createCodec(codec);
+    mimeType = encoder->mimeType;
+    if (!encoder->prepare()) throw std::runtime_error("can't open codec");
+
+    // DLNA features never change during streamer's life
+    char* DLNA_ORG = makeDLNA_ORG(encoder->id().c_str(), cacheMode != HTTP_CACHE_MEM, flow);
+    DLNAfeatures = DLNA_ORG;
+    free(DLNA_ORG);
+
+    scratchLen = flow ? encoder->icyInterval : 16384;
+    scratch = new uint8_t[scratchLen];
+    watermark = std::min(scratchLen, (size_t) 4096);
+  
+    // all streamers on this interface share the same listening socket
+    this->server = HTTPserver::get(addr);
+    this->port = server->getPort();
+}
+
+void HTTPstreamer::load(unsigned index, cspot::TrackInfo trackInfo, std::string_view trackUnique, int32_t startOffset) {
+    loaded = std::chrono::steady_clock::now();
+    this->streamId = id + "_" + std::to_string(index);
+    this->trackInfo = trackInfo;
+    this->trackUnique = trackUnique;
+    // for flow mode, start with a negative offset so that we can always substract
+    this->offset = startOffset;
+    stats = std::make_shared<streamMetrics>(id, streamId);
+    metrics::add(stats);
+
+    // now estimate the content-length
+    setContentLength(lengthMode);
+    offload();
+    this->streamUrl = "http://" + this->host + ":" + std::to_string(this->port) + HTTP_BASE_URL + "." + this->encoder->id() + "?id=" + this->streamId;
 }
 
 HTTPstreamer::~HTTPstreamer() {
     isRunning = false;
-    std::scoped_lock lock(runningMutex);
-    if (listenSock > 0) closesocket(listenSock);
+    server->detach(streamId);
+    /* engine might still be running a handler that closes a connection, so take them all 
+     * under the lock, but remove them from engine without it (engine locks us under its own) */
+    decltype(connections) closing;
+    {
+        std::scoped_lock lock(mutex);
+        closing.swap(connections);
+    }
+    // once removed from engine, handlers are guaranteed to not run anymore
+    for (auto& [sock, conn] : closing) {
+        HTTPengine::instance()->remove(sock);
+        closesocket(sock);
+    }
     delete[] scratch;
     CSPOT_LOG(info, "HTTP streamer %s deleted", streamId.c_str());
 }
 
 void HTTPstreamer::setContentLength(int64_t contentLength) {
+    std::scoped_lock lock(mutex);
     // offset is negative for start position
     int64_t requestedPos = -offset;
     uint64_t trackDuration = trackInfo.duration;
@@ -229,6 +623,8 @@ void HTTPstreamer::setContentLength(int64_t contentLength) {
     }
     
     int64_t length = encoder->initialize(duration);
+    lengthMode = contentLength;
+    byteRate = encoder->bitrate() / 8;
 
     if (!length) throw std::runtime_error("can't initialize codec");
 
@@ -250,104 +646,119 @@ void HTTPstreamer::getMetadata(metadata_t* metadata) {
 }
 
 void HTTPstreamer::flush() {
+    std::scoped_lock lock(mutex);
     totalOut = 0;
     state = OFF;
-    cache->flush();
-    encoder->flush();
-    icy.trackId.clear();
-}
-
-bool HTTPstreamer::connect(int sock) {
-    auto data = std::vector<uint8_t>();
-
-    // get the HTTP headers by chunks (there should be no body)
-    while (1) {
-        uint8_t buffer[256];
-        int n = recv(sock, (char*) buffer, sizeof(buffer), 0);
-
-        if (n <= 0)  return false;
-
-        data.insert(data.end(), buffer, buffer + n);
-        if (data.size() >= 4 && !memcmp(data.data() + data.size() - 4, "\r\n\r\n", 4)) break;
+    exhausted = false;
+    index.clear();
+    servedMax = 0;
+    metrics::set(stats->cacheLevel, (uint64_t) 0);
+    // a partial track can't be stored, and a stored one can't be served from a new position
+    store.reset();
+    if (stored) {
+        stored = 0;
+        encoder = createCodec(codec);
+        offload();
+        if (cacheMode == HTTP_CACHE_DISK) cache = std::make_unique<fileBuffer>();
+        else cache = std::make_unique<ringBuffer>();
+    } else {
+        cache->flush();
+        encoder->flush();
     }
+    for (auto& [sock, conn] : connections) {
+        conn->cursor = 0;
+        conn->icy.trackId.clear();
+    }
+    notifyCredit(true);
+}
 
-    // regex to remove leading and trailing spaces
-    std::regex expr("^\\s+|\\s+$");
-    size_t offset = 0;
-
-    auto nextLine = [&data, &offset](void) {
-        uint8_t* start, * end;
-        std::string line;
-        end = start = data.data() + offset;
-
-        // find eol
-        for (end = start = data.data() + offset;
-             offset < data.size() && *end != '\r' && *end != '\n';
-             end++, offset++);
-
-        if (offset < data.size()) {
-            line = std::string(start, end);
-            for (; (*end == '\r' || *end == '\n') && offset < data.size(); end++, offset++);
+void HTTPstreamer::useTrackCache(std::string_view source) {
+    auto tracks = trackCache::instance();
+    // only full tracks are stored, they make no sense in flow mode
+    if (!tracks || flow || offset) return;
+
+    std::scoped_lock lock(mutex);
+    auto key = trackCache::key(trackInfo.trackId, codec, source);
+    std::string path;
+    uint64_t size;
+
+    if (tracks->lookup(key, path, size)) {
+        try {
+            cache = std::make_unique<fileBuffer>(path);
+        } catch (std::exception& e) {
+            CSPOT_LOG(error, "can't serve %s from track cache (%s)", trackInfo.trackId.c_str(), e.what());
+            store = tracks->store(key);
+            return;
         }
+        // everything is there already, so we can have the real length and no encoder
+        stored = cache->total;
+        tracks->served(key, stored);
+        totalOut = stored;
+        metrics::set(stats->cacheLevel, stored);
+        if (lengthMode == HTTP_CL_REAL || lengthMode == HTTP_CL_KNOWN) contentLength = stored;
+        if (trackInfo.duration) byteRate = stored * 1000 / trackInfo.duration;
+        encoder.reset();
+    } else {
+        store = tracks->store(key);
+    }
+}
 
-        return line;
-    };
+void HTTPstreamer::park(bool parked) {
+    // not shared yet, so no need to lock
+    cache->park(parked);
+    if (encoder) encoder->park(parked);
+}
 
-    auto dump = std::string((char*)data.data(), data.size());
-    CSPOT_LOG(info, "HTTP received =>\n%s", dump.c_str());
+bool HTTPstreamer::connect(connection& conn, HTTPrequest& request) {
+    // unless proven otherwise below, we'll close after this response
+    conn.keepAlive = false;
+    conn.chunked = false;
+    conn.icy.interval = 0;
 
     // get the streamId 
-    auto request = nextLine();
-
-    if (request.find("?id=") == std::string::npos) {
-        CSPOT_LOG(error, "Incorrect HTTP request, can't find streamId %s", request.c_str());
+    if (request.target.find("?id=") == std::string_view::npos) {
+        CSPOT_LOG(error, "Incorrect HTTP request, can't find streamId %.*s", (int) request.line.size(), request.line.data());
         return false;
     }
 
     // check this is what's expected
-    if (request.find(streamId) == std::string::npos) {
-        CSPOT_LOG(info, "Wrong client/request %s not in  url %s", streamId.c_str(), request.c_str());
+    if (request.target.find(streamId) == std::string_view::npos) {
+        CSPOT_LOG(info, "Wrong client/request %s not in  url %.*s", streamId.c_str(), (int) request.line.size(), request.line.data());
         return false;
     }
 
-    HTTPheaders response, headers;
+    HTTPheaders extra;
 
-    // parse headers
-    for (auto line = nextLine(); !line.empty(); line = nextLine()) {
-        size_t pos = line.find(':');
-        if (pos == std::string::npos) continue;
-        for (auto it = line.begin(); it != line.end(); ++it) *it = tolower(*it);
-        headers[std::regex_replace(line.substr(0, pos), expr, "")] = std::regex_replace(line.substr(pos + 1), expr, "");
+    // get optional headers from whoever wants to have a say (only then we allocate)
+    if (onHeaders) {
+        HTTPheaders headers;
+        for (int i = 0; i < HTTPrequest::MAX_HEADERS; i++) {
+            if (request.has(i)) headers[HTTPrequest::names[i]] = request.headers[i];
+        }
+        extra = onHeaders(headers);
     }
 
-    // get optional headers from whoever wants to have a say
-    if (onHeaders) response = onHeaders(headers);
-
-    std::string status = "200 OK";
-    chunked = request.find("HTTP/1.1") != std::string::npos && contentLength == HTTP_CL_CHUNKED;
+    const char* status = "200 OK";
+    conn.chunked = request.version == "HTTP/1.1" && contentLength == HTTP_CL_CHUNKED;
 
-    bool sendBody = request.find("HEAD") == std::string::npos;
-    bool isSonos = headers["user-agent"].find("sonos") != std::string::npos;
+    bool sendBody = request.method != "HEAD";
+    bool isSonos = HTTPrequest::contains(request.headers[HTTPrequest::USER_AGENT], "sonos");
     // if we know the real length because it's a redo, then tell it if authorized
     int64_t length = (state == DRAINED && (contentLength >= 0 || contentLength == HTTP_CL_KNOWN)) ? totalOut : contentLength;
+    // what Content-Range header to add to the response
+    struct {
+        enum { NONE, OPEN, UNSATISFIED, BOUNDED } type = NONE;
+        size_t from = 0, to = 0;
+        int64_t length = 0;
+    } contentRange;
+    bool noExtra = false;
+    struct {
+        uint32_t start = 0, duration = 0;
+    } timeSeek;
     
     // check if icy metadata is requested
-    if (auto it = headers.find("icy-metadata"); it != headers.end() && flow) {
-       icy.remain = icy.interval = std::max(scratchLen, encoder->icyInterval);
-       response["icy-metaint"] = std::to_string(icy.interval);
-    }
-
-    // check various DLNA fields
-    if (auto it = headers.find("transferMode.dlna.org"); it != headers.end()) response["transferMode.dlna.org"] = it->second;
-    if (auto it = headers.find("getcontentFeatures.dlna.org"); it != headers.end()) {
-        char* DLNA_ORG = makeDLNA_ORG(encoder->id().c_str(), cacheMode != HTTP_CACHE_MEM, flow);
-        response["contentFeatures.dlna.org"] = DLNA_ORG;
-        free(DLNA_ORG);
-    }
-    if (auto it = headers.find("getAvailableSeekRange.dlna.org"); it != headers.end() && cache->total) {
-        response["contentFeatures.dlna.org"] = "availableSeekRange.dlna.org: 0 bytes=" +
-                                               std::to_string(cache->total - (cacheMode == HTTP_CACHE_MEM ? cache->level() : 0)) +
-                                               "-" + std::to_string(cache->total - 1);
+    if (request.has(HTTPrequest::ICY_METADATA) && flow) {
+       conn.icy.remain = conn.icy.interval = std::max(scratchLen, encoder->icyInterval);
     }
 
     /* There is a fair bit of HTTP soup below and the problem is many Sonos speakers. When paused
@@ -360,57 +771,86 @@ bool HTTPstreamer::connect(int sock) {
      * compliant) or they fail as well */
 
     // by default, use cache and restart from oldest (might change that below)
-    useCache = true;
-    cache->setOffset(0);
+    conn.cursor = cache->oldest();
+
+    // handle time-seek request (not in flow mode where time is meaningless)
+    if (uint32_t ms; request.has(HTTPrequest::TIME_SEEK) && !flow) {
+        uint64_t offset;
+        uint32_t duration = trackInfo.duration + this->offset;
 
-    // handle range-request 
-    if (auto it = headers.find("range"); it != headers.end() && cache->total) {
+        if (!HTTPrequest::npt(request.headers[HTTPrequest::TIME_SEEK], ms)) {
+            sendBody = false;
+            status = "400 Bad Request";
+            noExtra = true;
+        } else if (ms <= duration && index.find(ms, offset) && cache->scope(offset) == 0 && offset < cache->total) {
+            // DLNA wants a 200 and the actual position we serve from
+            conn.cursor = offset;
+            length = 0;
+            timeSeek = { ms, duration };
+            CSPOT_LOG(info, "time-seek at %u ms served from offset %" PRIu64 " (cached:%zu)", ms, offset, cache->total);
+        } else {
+            sendBody = false;
+            status = "416 Range Not Satisfiable";
+            noExtra = true;
+            CSPOT_LOG(info, "can't time-seek at %u ms (cached:%zu)", ms, cache->total);
+        }
+    } else if (request.has(HTTPrequest::RANGE) && cache->total) {
         size_t offset = 0;
-        (void) !sscanf(it->second.c_str(), "bytes=%zu", &offset);
+        auto range = request.headers[HTTPrequest::RANGE];
+        if (range.size() > 6 && HTTPrequest::contains(range.substr(0, 6), "bytes=")) {
+            for (auto c : range.substr(6)) {
+                if (c < '0' || c > '9') break;
+                offset = offset * 10 + c - '0';
+            }
+        }
 
         // this is not an initial request (there is cache), so if offset is 0, we are all set
         if (offset) {
             if (state != DRAINED && cache->total == offset) {
                 // special case where we just continue so we'll do a 200 with no cache
-                useCache = false;
+                conn.cursor = cache->total;
             } else if (cache->scope(offset) == 0) {
                 // first try to see if we can serve that
                 status = "206 Partial Content";
-                // see note above
-                if (!isSonos) response["Content-Range"] = "bytes " + std::to_string(offset) + 
-                                                          "-" + std::to_string(cache->total - 1) + "/*";
-                // do not sent content-length on PartialResponse
-                cache->setOffset(offset);
+                conn.cursor = offset;
                 CSPOT_LOG(info, "service partial-content %zu-%zu (length:%" PRId64 ")", offset, cache->total - 1, length);
-                length = 0;
+                if (stored && !isSonos) {
+                    // stored track has a known size, so this can be a proper partial response
+                    contentRange = { contentRange.BOUNDED, offset, cache->total - 1, (int64_t) stored };
+                    length = stored - offset;
+                } else {
+                    // see note above
+                    if (!isSonos) contentRange = { contentRange.OPEN, offset, cache->total - 1 };
+                    // do not sent content-length on PartialResponse
+                    length = 0;
+                }
             } else if (state == DRAINED && offset >= cache->total) {
                 // there is an offset out of scope and we are drained, we are tapping in estimated length
                 sendBody = false;
                 status = "416 Range Not Satisfiable";
-                response.clear();
-                response["Content-Range"] = "bytes */" + std::to_string(cache->total);
+                noExtra = true;
+                contentRange = { contentRange.UNSATISFIED, 0, 0, (int64_t) cache->total };
                 CSPOT_LOG(info, "can't serve offset %zu (cached:%zu)", offset, cache->total);
             } else {
                 // this likely means we are being probed toward the end of the file (which we don't have)
                 status = "206 Partial Content";
                 size_t avail = std::min(cache->total, (size_t) (length - offset));
-                cache->setOffset(cache->total - avail);
-                response["Content-Range"] = "bytes " + std::to_string(offset) +
-                    "-" + std::to_string(offset + avail - 1) + "/" + std::to_string(length);
+                conn.cursor = cache->total - avail;
+                contentRange = { contentRange.BOUNDED, offset, offset + avail - 1, length };
                 CSPOT_LOG(info, "being probed at %zu but have %zu/%" PRId64 ", using offset at %zu", offset,
                                  cache->total, length, cache->total - avail);
                 length = 0;
             }
-        } else if (state == DRAINED) {
+        } else if (state == DRAINED && !stored) {
             sendBody = false;
             status = "410 Gone";
-            response.clear();
+            noExtra = true;
             CSPOT_LOG(info, "won't resend from start when already fully served");
         }
-    } else if (state == DRAINED) {
+    } else if (state == DRAINED && !stored) {
         sendBody = false;
         status = "410 Gone";
-        response.clear();
+        noExtra = true;
         CSPOT_LOG(info, "won't resend from start when already fully served");
     } else if (cache->total) {
         // restart from the beginning if we have cache (see note above regarding Sonos)
@@ -418,83 +858,279 @@ bool HTTPstreamer::connect(int sock) {
         CSPOT_LOG(info, "service with cache from %zu (cached:%zu)", cache->total - cache->level(), cache->total);
     } else {
         // initial request, don't use cache (there is non anyway)
-        useCache = false;
+        conn.cursor = cache->total;
     }
 
-    // c++ conversion to string is really a joke
-    std::stringstream responseStr;
-    responseStr << (chunked ? "HTTP/1.1 " : "HTTP/1.0 ") + status + "\r\n";
+    // connection can only be re-used when the response delimits itself
+    bool chunked = conn.chunked;
+    if (sendBody && length > 0) conn.chunked = false;
+    conn.keepAlive = request.keepAlive() && (!sendBody || conn.chunked);
+
+    response.status(chunked || conn.keepAlive ? "HTTP/1.1" : "HTTP/1.0", status);
     
     if (sendBody) {
-        if (length > 0) {
-            chunked = false;
-            responseStr << "Content-Length: " + std::to_string(length) + "\r\n";
-        } else if (chunked) {
-            responseStr << "Transfer-Encoding: chunked\r\n";
+        if (length > 0) response.header("Content-Length", "%" PRId64, length);
+        else if (conn.chunked) response.header("Transfer-Encoding", "chunked");
+    } else if (conn.keepAlive && request.method != "HEAD") {
+        response.header("Content-Length", "0");
+    }
+
+    if (contentRange.type == contentRange.OPEN) {
+        response.header("Content-Range", "bytes %zu-%zu/*", contentRange.from, contentRange.to);
+    } else if (contentRange.type == contentRange.UNSATISFIED) {
+        response.header("Content-Range", "bytes */%" PRId64, contentRange.length);
+    } else if (contentRange.type == contentRange.BOUNDED) {
+        response.header("Content-Range", "bytes %zu-%zu/%" PRId64, contentRange.from, contentRange.to, contentRange.length);
+    }
+
+    // all these are dropped when we fail
+    if (!noExtra) {
+        if (request.has(HTTPrequest::SEEK_RANGE) && cache->total) {
+            response.header("availableSeekRange.dlna.org", "0 bytes=%zu-%zu", 
+                            cache->total - (cacheMode == HTTP_CACHE_MEM ? cache->level() : 0), cache->total - 1);
+        }
+        if (timeSeek.duration) {
+            response.header("TimeSeekRange.dlna.org", "npt=%u.%03u-%u.%03u/%u.%03u", timeSeek.start / 1000, timeSeek.start % 1000,
+                            timeSeek.duration / 1000, timeSeek.duration % 1000, timeSeek.duration / 1000, timeSeek.duration % 1000);
+        }
+        if (request.has(HTTPrequest::CONTENT_FEATURES)) response.header("contentFeatures.dlna.org", "%s", DLNAfeatures.c_str());
+        if (conn.icy.interval) response.header("icy-metaint", "%zu", conn.icy.interval);
+        if (request.has(HTTPrequest::TRANSFER_MODE)) {
+            auto& mode = request.headers[HTTPrequest::TRANSFER_MODE];
+            response.header("transferMode.dlna.org", "%.*s", (int) mode.size(), mode.data());
         }
+        for (auto& [name, value] : extra) response.header(name.c_str(), "%s", value.c_str());
+    } else {
+        conn.icy.interval = 0;
     }
 
-    // send accumulated headers
-    for (auto it = response.cbegin(); it != response.cend(); ++it) responseStr << it->first + ": " + it->second + "\r\n";
-    responseStr << "Server: spot-connect\r\n";
-    responseStr << "Accept-Ranges: bytes\r\n";
-    responseStr << "Content-Type: " + encoder->mimeType + "\r\n";
-    responseStr << "Connection: close\r\n";
-    responseStr << "\r\n";
+    response.header("Server", "spot-connect");
+    response.header("Accept-Ranges", "bytes");
+    response.header("Content-Type", "%s", mimeType.c_str());
+    response.header("Connection", conn.keepAlive ? "keep-alive" : "close");
+    response.end();
     
-    send(sock, responseStr.str().c_str(), responseStr.str().size(), 0);
-    CSPOT_LOG(info, "HTTP response =>\n%s", responseStr.str().c_str());
+    queue(conn, (uint8_t*) response.data(), response.size(), true);
+    CSPOT_LOG(info, "HTTP response =>\n%.*s", (int) response.size(), response.data());
 
     return sendBody;
 }
 
-ssize_t HTTPstreamer::sendChunk(int sock, uint8_t* data, ssize_t size, bool count) {
-    if (chunked) {
-        char chunk[16];
-        sprintf(chunk, "%zx\r\n", size);
-        if (send(sock, chunk, strlen(chunk), 0) < 0) return 0;
+void HTTPstreamer::queue(connection& conn, const uint8_t* data, size_t size, bool copy) {
+    if (!size) return;
+
+    // small framing data is copied and referenced by offset as storage might move
+    if (copy) {
+        conn.pending.push_back({ NULL, conn.framing.size(), size });
+        conn.framing.insert(conn.framing.end(), data, data + size);
+    } else {
+        conn.pending.push_back({ data, 0, size });
+    }
+}
+
+bool HTTPstreamer::sendPending(connection& conn) {
+    auto& pending = conn.pending;
+
+    while (conn.pendingPos < pending.size()) {
+        const size_t maxIov = 16;
+#ifdef _WIN32
+        WSABUF iov[maxIov];
+#else
+        struct iovec iov[maxIov];
+#endif
+        size_t count = 0, bytes = 0;
+
+        // gather as many segments as possible in a single syscall
+        for (size_t i = conn.pendingPos; i < pending.size() && count < maxIov; i++, count++) {
+            auto& segment = pending[i];
+            size_t skip = i == conn.pendingPos ? conn.pendingSent : 0;
+            const uint8_t* data = (segment.data ? segment.data : conn.framing.data() + segment.offset) + skip;
+#ifdef _WIN32
+            iov[count].buf = (char*) data;
+            iov[count].len = segment.size - skip;
+#else
+            iov[count].iov_base = (void*) data;
+            iov[count].iov_len = segment.size - skip;
+#endif
+            bytes += segment.size - skip;
+        }
+
+#ifdef _WIN32
+        DWORD written;
+        ssize_t sent = WSASend(conn.sock, iov, count, &written, 0, NULL, NULL) ? -1 : (ssize_t) written;
+#else
+        struct msghdr msg = { };
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(conn.sock, &msg, 0);
+#endif
+        conn.sendCalls++;
+
+        if (sent < 0) {
+            if (HTTPengine::wouldBlock()) return true;
+#ifdef _WIN32
+            int error = WSAGetLastError();
+#else
+            int error = errno;
+#endif
+            CSPOT_LOG(error, "HTTP error %d for %s => send %zd / %zu (%d)", error, streamId.c_str(), sent, bytes, conn.sock);
+            return false;
+        }
+
+        conn.sendBytes += sent;
+        metrics::inc(stats->sent, (uint64_t) sent);
+
+        // consume segments that have been fully sent
+        for (conn.pendingSent += sent; conn.pendingPos < pending.size() && conn.pendingSent >= pending[conn.pendingPos].size; conn.pendingPos++) {
+            conn.pendingSent -= pending[conn.pendingPos].size;
+        }
+
+        // socket is full
+        if ((size_t) sent < bytes) return true;
     }
 
-    ssize_t bytes = size;
+    pending.clear();
+    conn.framing.clear();
+    conn.pendingPos = conn.pendingSent = 0;
+    return true;
+}
+
+ssize_t HTTPstreamer::sendChunk(connection& conn, uint8_t* data, ssize_t size, bool copy) {
+    // payload is referenced (scratch is not reused until sent), only framing is copied
+    char header[16];
+    if (conn.chunked) queue(conn, (uint8_t*) header, sprintf(header, "%zx\r\n", size), true);
+
+    queue(conn, data, size, copy);
+
+    // might be chunked mode, but no reason to send and end-of-chunk
+    if (conn.chunked) queue(conn, (uint8_t*) "\r\n", 2, true);
+
+    return size;
+}
 
-    while (bytes) {
-        ssize_t sent = send(sock, (char*) data + size - bytes, bytes, 0);
-        // might be chunked mode, but no reason to send and end-of-chunk
-        if (sent < 0) return size - bytes;
-        bytes -= sent;
+size_t HTTPstreamer::produce(void) {
+    // stored track is already fully in cache
+    if (!encoder) {
+        exhausted = true;
+        return 0;
     }
 
-    if (chunked) {
-        send(sock, "\r\n", 2, 0);
+    // encoder output goes to cache once, then all clients read it from there
+    size_t size = encoder->read(scratch, scratchLen, 0, state == DRAINING);
+    // when draining, encoder's tail is flushed by the pool that wakes us up when done
+    exhausted = !size && state == DRAINING && encoder->isDrained();
+    cache->write(scratch, size);
+    totalOut += size;
+    metrics::inc(stats->encodedOut, (uint64_t) size);
+    metrics::set(stats->cacheLevel, (uint64_t) cache->level());
+    metrics::set(stats->backlog, (uint64_t) encoder->buffered());
+    if (size) notifyCredit();
+
+    if (store && size) {
+        store->write(scratch, size);
+    } else if (store && exhausted) {
+        // encoder is fully drained, but cspot might have stopped early
+        if (encoder->pcmToMs(totalIn) + 1000 >= trackInfo.duration) {
+            // header was written with an estimated length, stored copy can have the real one
+            store->patch([this](uint8_t* data, size_t size, uint64_t length) { encoder->patchHeader(data, size, length, totalIn); });
+            trackCache::instance()->commit(std::move(store));
+        }
+        store.reset();
     }
 
-    if (count) totalOut += size;
+    // decoding can only resume where codec says a frame starts, once that frame is in cache
+    for (uint64_t position, offset; encoder->syncPoint(cache->total, position, offset);) {
+        index.add(encoder->pcmToMs(position), offset);
+    }
     return size;
 }
 
-ssize_t HTTPstreamer::streamBody(int sock, struct timeval& timeout) {
-    ssize_t size = 0;
+void HTTPstreamer::setPacing(uint32_t burst, uint32_t rate) {
+    std::scoped_lock lock(mutex);
+    this->burst = burst;
+    this->rate = rate;
+}
+
+size_t HTTPstreamer::allowance(connection& conn) {
+    if (!rate || !byteRate) return SIZE_MAX;
+
+    // what has been earned so far: the burst, then real-time (times rate) since body started
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - conn.pace.start).count();
+    uint64_t earned = (uint64_t) byteRate * (burst + elapsed * rate / 100) / 1000;
+    if (earned > conn.pace.sent) return earned - conn.pace.sent;
+
+    // come back when we can send a decent amount at once, not a few bytes
+    uint64_t target = (conn.pace.sent + watermark) * 1000 / byteRate;
+    int64_t delay = target > burst ? (int64_t) ((target - burst) * 100 / rate) - elapsed : 0;
+    HTTPengine::instance()->timer(conn.sock, std::max(delay, (int64_t) 1));
+    conn.pace.paused = true;
+    return 0;
+}
+
+bool HTTPstreamer::headroom(connection& conn) {
+    /* When renderers of a group read the same stream, the fastest one triggers encoding but 
+     * it must not get so much ahead that the cache overwrites what the slowest has not read 
+     * yet. Clients that have not taken anything for a while are not waiting for us (some 
+     * players leave idle connections open) so they don't hold the others */
+    auto now = std::chrono::steady_clock::now();
+    size_t slowest = conn.cursor;
+    for (auto& [sock, other] : connections) {
+        if (other->body && other->cursor < slowest && now - other->pace.active < std::chrono::seconds(2)) slowest = other->cursor;
+    }
+    if (cache->total - slowest + scratchLen <= cache->capacity()) return true;
+
+    // check again a bit later, slowest will have caught up
+    HTTPengine::instance()->timer(conn.sock, 50);
+    conn.pace.paused = true;
+    return false;
+}
+
+ssize_t HTTPstreamer::streamBody(connection& conn) {
+    // get fresh data from encoder when this client has consumed all the cache (and others can follow)
+    if (conn.cursor >= cache->total && (state == DRAINED || !headroom(conn) || !produce())) return 0;
+
+    // client is ahead of its pace, wait for timer
+    size_t allowed = allowance(conn);
+    if (!allowed) return 0;
 
-    // cache has priority
-    if (useCache) {
-        size = cache->read(scratch, scratchLen);
-        if (!size) useCache = false;
+    // when body is sent as-is, let the kernel send cached data straight from file
+    if (conn.cursor > servedMax) {
+        servedMax = conn.cursor;
+        if (stored) notifyCredit();
     }
 
-    // not using cache or empty cache, get fresh data from encoder
-    if (!size) {
-        size = encoder->read(scratch, scratchLen, 0, state == DRAINING);
-        // cache what we have anyway
-        cache->write(scratch, size);
+    if (zeroCopy && !conn.chunked && !conn.icy.interval) {
+        ssize_t sent = cache->sendTo(conn.sock, conn.cursor, std::min(scratchLen * 4, allowed));
+        conn.sendCalls++;
+
+        if (sent > 0) {
+            conn.sendBytes += sent;
+            conn.pace.sent += sent;
+            conn.pace.active = std::chrono::steady_clock::now();
+            metrics::inc(stats->sent, (uint64_t) sent);
+            return sent;
+        } else if (sent < 0 && HTTPengine::wouldBlock()) {
+            conn.stalled = true;
+            return 0;
+        } else if (sent < 0 && (errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            CSPOT_LOG(debug, "zero-copy not available for %s, using copy", streamId.c_str());
+            zeroCopy = false;
+        } else if (sent < 0) {
+            return -1;
+        }
     }
 
+    if (!conn.scratch) conn.scratch = std::make_unique<uint8_t[]>(scratchLen);
+    uint8_t* scratch = conn.scratch.get();
+    ssize_t size = cache->read(conn.cursor, scratch, std::min(scratchLen, allowed));
+
     // we really have nothing, let caller decide what's next
-    if (!size) {
-        timeout.tv_usec = 50 * 1000;
-        return 0;
-    }
+    if (!size) return 0;
+    conn.pace.sent += size;
+    conn.pace.active = std::chrono::steady_clock::now();
 
     int offset = 0;
+    auto& icy = conn.icy;
 
     // check if ICY sending is active (len < ICY_INTERVAL)
     if (icy.interval && size > icy.remain) {
@@ -518,113 +1154,298 @@ ssize_t HTTPstreamer::streamBody(int sock, struct timeval& timeout) {
 
         // send remaining data first
         offset = icy.remain;
-        if (offset) sendChunk(sock, (uint8_t*)scratch, offset, !useCache);
+        if (offset) sendChunk(conn, scratch, offset);
         size -= offset;
 
         // then send icy data
-        sendChunk(sock, (uint8_t*) buffer, len_16 * 16 + 1, false);
+        sendChunk(conn, (uint8_t*) buffer, len_16 * 16 + 1, true);
         icy.remain = icy.interval;
     }
 
-    ssize_t sent = sendChunk(sock, (uint8_t*) scratch + offset, size, !useCache);
+    sendChunk(conn, scratch + offset, size);
     
     // update remaining count with desired length
     if (icy.interval) icy.remain -= size;
 
-    if (sent != size) {
-#ifdef _WIN32
-        int error = WSAGetLastError();
-#else
-        int error = errno;
-#endif
-        CSPOT_LOG(error, "HTTP error %d for %s => send %zd / %zd (%d)", error, streamId.c_str(), sent, size, sock);
-        return sent - size;
+    return size;
+}
+
+size_t HTTPstreamer::backlog(void) {
+    /* What the slowest renderer has not acknowledged is still buffered, only in its socket, 
+     * so decoder must be throttled by it or a slow renderer lets us run far ahead. Like for
+     * headroom(), clients that are not reading anymore don't count */
+    auto now = std::chrono::steady_clock::now();
+    size_t queued = 0;
+    for (auto& [sock, conn] : connections) {
+        if (conn->body && now - conn->pace.active < std::chrono::seconds(2)) queued = std::max(queued, conn->queued);
     }
+    // as PCM (44.1kHz/16/2)
+    uint32_t bitrate = encoder ? std::max(encoder->bitrate(), 1U) : 44100 * 4 * 8;
+    return (uint64_t) queued * 44100 * 4 * 8 / bitrate;
+}
 
-    timeout.tv_usec = 0;   
-    return size;
+size_t HTTPstreamer::available(void) {
+    if (!isRunning) return 0;
+    size_t credit, lag = backlog();
+
+    if (!stored) {
+        credit = encoder->credit();
+    } else {
+        // nothing to encode, but pace decoder as if we did, with 44.1kHz/16/2 and a ~24s lead
+        uint64_t expected = (uint64_t) trackInfo.duration * 44100 * 4 / 1000;
+        uint64_t limit = expected * servedMax / stored + 4 * 1024 * 1024;
+        credit = limit > totalIn ? limit - totalIn : 0;
+    }
+
+    return credit > lag ? credit - lag : 0;
+}
+
+void HTTPstreamer::offload(void) {
+    // encoding is done by the pool, which tells us when there is something for waiting clients
+    encoder->offload([self = weak_from_this()] {
+        if (auto streamer = self.lock()) {
+            streamer->wake();
+            std::scoped_lock lock(streamer->mutex);
+            streamer->notifyCredit();
+        }
+    });
+}
+
+size_t HTTPstreamer::credit(void) {
+    std::scoped_lock lock(mutex);
+    return available();
+}
+
+bool HTTPstreamer::waitCredit(size_t size, uint32_t timeout) {
+    std::unique_lock lock(mutex);
+    // don't resume for a few bytes, or we'll be woken up for every encoded frame
+    credited = std::max(size, resumeCredit);
+    bool ready = creditCond.wait_for(lock, std::chrono::milliseconds(timeout), [this] {
+        return !isRunning || state >= DRAINING || available() >= credited;
+    });
+    credited = 0;
+    return ready && available() >= size;
+}
+
+void HTTPstreamer::notifyCredit(bool force) {
+    // must be called with streamer's lock
+    if (credited && (force || available() >= credited)) creditCond.notify_all();
 }
 
 bool HTTPstreamer::feedPCMFrames(const uint8_t* data, size_t size) {
-    if (isRunning && encoder->pcmWrite(data, size)) {
+    if (isRunning && stored) {
+        if (available() < size) return false;
+        totalIn += size;
+        metrics::inc(stats->pcmIn, (uint64_t) size);
+        return true;
+    } else if (isRunning && encoder->pcmWrite(data, size)) {
         totalIn += size;
+        metrics::inc(stats->pcmIn, (uint64_t) size);
+        metrics::set(stats->backlog, (uint64_t) encoder->buffered());
+        if (starving && encoder->pending() >= watermark) wake();
         return true;
     } else {
         return false;
     }
 }
 
-void HTTPstreamer::runTask() {
-    std::scoped_lock lock(runningMutex);
+void HTTPstreamer::drain(void) {
+    state = DRAINING;
+    {
+        // decoder won't send anything anymore, don't keep it waiting
+        std::scoped_lock lock(mutex);
+        notifyCredit(true);
+    }
+    // no more data will come, so clients waiting for it must now finish
+    wake(true);
+}
+
+void HTTPstreamer::wake(bool force) {
+    // only one wake-up in flight, the flag is re-armed when clients starve again
+    if (!starving.exchange(false) && !force) return;
+    HTTPengine::instance()->post([self = weak_from_this()] {
+        if (auto streamer = self.lock()) streamer->onWake();
+    });
+}
+
+void HTTPstreamer::onWake(void) {
+    std::scoped_lock lock(mutex);
+
+    // pump might close connections, so iterate carefully
+    for (auto it = connections.begin(); it != connections.end();) {
+        auto& conn = *(it++)->second;
+        if (conn.body && conn.pending.empty()) pump(conn);
+    }
+}
+
+void HTTPstreamer::start(void) {
     isRunning = true;
+    server->attach(streamId, weak_from_this());
+}
 
-    int sock = -1;
-    struct timeval timeout = { 0, 25 * 1000 };
+void HTTPstreamer::accept(int sock, std::vector<uint8_t>& request) {
+    std::scoped_lock lock(mutex);
 
-    while (isRunning) {
-        fd_set rfds;
-        bool success = true;
+    if (connections.size() >= maxConnections) {
+        const char* response = "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        CSPOT_LOG(info, "too many connections for %s, rejecting %d", streamId.c_str(), sock);
+        (void) !send(sock, response, strlen(response), 0);
+        closesocket(sock);
+        return;
+    }
 
-        if (sock == -1) {
-            struct timeval timeout = { 0, 50 * 1000 };
+    auto& conn = *(connections[sock] = std::make_unique<connection>(sock));
+    conn.request = std::move(request);
+    HTTPengine::instance()->add(sock, HTTPengine::READ, [this](int sock, uint32_t events) {
+        onEvent(sock, events);
+    });
 
-            FD_ZERO(&rfds);
-            FD_SET(listenSock, &rfds);
+    metrics::set(stats->connections, (uint32_t) connections.size());
+    CSPOT_LOG(info, "serving %d for %s (%zu clients)", sock, streamId.c_str(), connections.size());
+    onRequest(conn);
+    pump(conn);
+}
 
-            if (select(listenSock + 1, &rfds, NULL, NULL, &timeout) > 0) {
-                sock = accept(listenSock, NULL, NULL);
-            }
+void HTTPstreamer::closeSocket(connection& conn, const char* reason) {
+    CSPOT_LOG(info, "%s %d (sent:%zu)", reason, conn.sock, totalOut);
+    if (conn.sendBytes) CSPOT_LOG(debug, "%s sent %" PRIu64 " bytes with %" PRIu64 " syscalls (%.1f/MB)", streamId.c_str(), 
+                                  conn.sendBytes, conn.sendCalls, conn.sendCalls * 1048576.0 / conn.sendBytes);
+    HTTPengine::instance()->remove(conn.sock);
+    closesocket(conn.sock);
+    // this deletes the connection
+    connections.erase(conn.sock);
+    metrics::set(stats->connections, (uint32_t) connections.size());
+}
+
+bool HTTPstreamer::onRequest(connection& conn) {
+    // there might be more than one request (pipelining)
+    size_t size = HTTPrequest::length(conn.request.data(), conn.request.size());
+    if (!size) return false;
+
+    HTTPrequest request;
+    CSPOT_LOG(info, "HTTP received =>\n%.*s", (int) size, (char*) conn.request.data());
+
+    if (request.parse(conn.request.data(), size)) {
+        conn.body = connect(conn, request);
+    } else {
+        CSPOT_LOG(error, "Malformed HTTP request");
+        conn.body = conn.keepAlive = false;
+    }
+
+    conn.request.erase(conn.request.begin(), conn.request.begin() + size);
+
+    // we might already be in draining mode
+    if (conn.body && state <= STREAMING) state = STREAMING;
+
+    // every response gets its own burst
+    conn.pace.active = conn.pace.start = std::chrono::steady_clock::now();
+    conn.pace.sent = 0;
+
+    // terminate connection if required by HTTP peer (once response is sent)
+    if (!conn.body && !conn.keepAlive) conn.closing = true;
+    return true;
+}
 
-            if (sock == -1 || !isRunning) continue;
-            CSPOT_LOG(info, "got HTTP connection %u", sock);
+void HTTPstreamer::onEvent(int sock, uint32_t events) {
+    std::scoped_lock lock(mutex);
+    auto it = connections.find(sock);
+    if (it == connections.end()) return;
+    auto& conn = *it->second;
+
+    if (events & HTTPengine::READ) {
+        uint8_t buffer[256];
+        ssize_t n = recv(sock, (char*) buffer, sizeof(buffer), 0);
+
+        // peer has closed or error
+        if (n == 0 || (n < 0 && !HTTPengine::wouldBlock())) {
+            closeSocket(conn, conn.body ? "early closing socket" : "HTTP close");
+            return;
         }
 
-        FD_ZERO(&rfds);
-        FD_SET(sock, &rfds);
+        // get the HTTP headers by chunks (there should be no body)
+        if (n > 0) conn.request.insert(conn.request.end(), buffer, buffer + n);
+        if (conn.request.size() > 8192) return closeSocket(conn, "HTTP request too large");
 
-        int n = select(sock + 1, &rfds, NULL, NULL, &timeout);
+        // next request will only be served once current response is done
+        if (!conn.body && conn.pending.empty()) onRequest(conn);
+    }
+
+    pump(conn);
+}
 
-        if (n > 0) {
-            success = connect(sock);
-            // we might already be in draining mode
-            if (success && state <= STREAMING) state = STREAMING;
-            else if (state == DRAINED) useCache = true;
+void HTTPstreamer::pump(connection& conn) {
+    // try to stream some data as long as socket accepts it
+    while (true) {
+        if (!sendPending(conn)) return closeSocket(conn, "early closing socket");
+
+        // socket is full, wait for it to be writable
+        if (!conn.pending.empty()) break;
+
+        if (conn.closing) {
+            if (state == DRAINED) shutdown(conn.sock, SHUT_RDWR);
+            return closeSocket(conn, state == DRAINED ? "closed lingering socket" : "HTTP close");
         }
 
-        // terminate connection if required by HTTP peer
-        if (n < 0 || (!success && state <= CONNECTING)) {
-            CSPOT_LOG(info, "HTTP close %u (sent:%zu)", sock, totalOut);
-            closesocket(sock);
-            sock = -1;
-            if (state == STREAMING) state = CONNECTING;
-            continue;
+        conn.stalled = conn.pace.paused = false;
+        ssize_t sent = conn.body && state >= STREAMING ? streamBody(conn) : 0;
+
+        if (sent < 0) return closeSocket(conn, "early closing socket");
+
+        if (sent > 0 && !served) {
+            served = true;
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - loaded).count();
+            metrics::set(stats->firstByte, (uint32_t) elapsed);
+            CSPOT_LOG(info, "first byte of %s served %u ms after load", streamId.c_str(), (uint32_t) elapsed);
         }
 
-        // try to stream some data 
-        ssize_t sent = state >= STREAMING || (state == DRAINED && useCache) ? streamBody(sock, timeout) : 0;
+        // zero-copy send could not proceed, wait for socket to be writable (or for pacing timer)
+        if (conn.stalled || conn.pace.paused) break;
 
-        if (state >= DRAINING && !sent) {
-           // chunked-encoding terminates by a last empty chunk ending sequence
-           if (chunked) send(sock, "0\r\n\r\n", 5, 0);
+        if (conn.body && state >= DRAINING && !sent && exhausted) {
+            // chunked-encoding terminates by a last empty chunk ending sequence
+            if (conn.chunked) queue(conn, (uint8_t*) "0\r\n\r\n", 5, true);
 
-           CSPOT_LOG(info, "closing socket %d (sent:%zu), now lingering", sock, totalOut);
-           if (state == DRAINING && onEoS) onEoS(this);
-           state = DRAINED;      
+            if (state == DRAINING && onEoS) {
+                // EoS handler takes player's lock, so it can't be called from engine's context
+                HTTPengine::instance()->post([self = weak_from_this()] {
+                    if (auto streamer = self.lock()) streamer->onEoS(streamer.get());
+                });
+            }
+            state = DRAINED;
+            conn.body = false;
 
-           shutdown(sock, SHUT_RDWR);
-           closesocket(sock);
-           sock = -1;
-        } else if (sent < 0) {
-            // something happened in streamBody, let's close the socket and wait for next request
-            CSPOT_LOG(info, "early closing socket %d (sent:%zu)", sock, totalOut);
-            closesocket(sock);
-            sock = -1;
-        } else {
-            timeout.tv_usec = 50 * 1000;
+            if (!conn.keepAlive) {
+                CSPOT_LOG(info, "closing socket %d (sent:%zu), now lingering", conn.sock, totalOut);
+                conn.closing = true;
+            } else {
+                CSPOT_LOG(info, "response done on %d (sent:%zu), keeping alive", conn.sock, totalOut);
+            }
+        } else if (!sent) {
+            // response is complete, serve pipelined request if any
+            if (!conn.body && conn.keepAlive && onRequest(conn)) continue;
+            if (!conn.body || state < STREAMING) break;
+            // nothing to send, wait for producer but make sure we did not miss it
+            starving = true;
+            if (!encoder || (!encoder->pending() && !encoder->isDrained())) break;
+            starving = false;
         }
     }
 
-    isRunning = false;
+#ifdef __linux__
+    // what renderer has not acknowledged yet, i.e. how much it is behind what we sent
+    if (int queued; conn.body && !ioctl(conn.sock, SIOCOUTQ, &queued)) {
+        metrics::set(stats->socketQueue, (uint64_t) queued);
+        // decoder's credit depends on it, so let it know when renderer catches up
+        bool drained = (size_t) queued < conn.queued;
+        conn.queued = queued;
+        if (drained) notifyCredit();
+        // when decoder waits and we have nothing to send, nothing else would bring us back here
+        if (credited && queued && !conn.stalled && !conn.pace.paused) HTTPengine::instance()->timer(conn.sock, 50);
+    }
+#endif
+
+    // only wait for socket to be writable when we have something to send
+    HTTPengine::instance()->modify(conn.sock, HTTPengine::READ | (conn.stalled || !conn.pending.empty() ? HTTPengine::WRITE : 0));
 }
 
 /* DLNA.ORG_CI: conversion indicator parameter (integer)
@@ -699,22 +1520,103 @@ char* makeDLNA_ORG(const char *codec, bool infiniteCache, bool live) {
      * don't have access to it until we have received full content. As it is supposed to
      * represent what is accessible, not the media itself, we'll always set it. We can still use
      * partial cache, so b29 shall be set (then OP shall not be). If user has opted-out file
-     * cache (or no fake), we can only do b29. In any case, we don't support time-based seek */
+     * cache (or no fake), we can only do b29. Time-based seek follows the same logic (OP or 
+     * b30) as it is served from cache using an index of encoded positions, but not when live.
+     * It is also only possible for formats that can be decoded from any frame, as response
+     * starts at a frame in the middle of the stream, without headers */
     
+     bool timeSeek = !live;
+     if (strncasecmp(codec, "mp3", 3) && strncasecmp(codec, "aac", 3) && strncasecmp(codec, "pcm", 3) &&
+         strncasecmp(codec, "wav", 3) && strncasecmp(codec, "L16", 3)) timeSeek = false;
+
      uint32_t org_op = infiniteCache ? DLNA_ORG_OPERATION_RANGE : 0;
+     if (infiniteCache && timeSeek) org_op |= DLNA_ORG_OPERATION_TIMESEEK;
      uint32_t org_flags = DLNA_ORG_FLAG_STREAMING_TRANSFERT_MODE | DLNA_ORG_FLAG_BACKGROUND_TRANSFERT_MODE |
                           DLNA_ORG_FLAG_CONNECTION_STALL | DLNA_ORG_FLAG_DLNA_V15 |
                           DLNA_ORG_FLAG_SN_INCREASE;
 
      if (live) org_flags |= DLNA_ORG_FLAG_S0_INCREASE;
      if (!infiniteCache) org_flags |= DLNA_ORG_FLAG_BYTE_BASED_SEEK;
+     if (!infiniteCache && timeSeek) org_flags |= DLNA_ORG_FLAG_TIME_BASED_SEEK;
 
-     size_t n = snprintf(NULL, 0, "%sDLNA.ORG_OP=%02u;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08x000000000000000000000000",
+     size_t n = snprintf(NULL, 0, "%sDLNA.ORG_OP=%02x;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08x000000000000000000000000",
                               DLNAOrgPN, org_op, org_flags);
 
      char* DLNA = (char*) malloc(n + 1);
-     (void) !snprintf(DLNA, n + 1, "%sDLNA.ORG_OP=%02u;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08x000000000000000000000000",
+     (void) !snprintf(DLNA, n + 1, "%sDLNA.ORG_OP=%02x;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=%08x000000000000000000000000",
                                                  DLNAOrgPN, org_op, org_flags);
      return DLNA;
 }
 
+
+/****************************************************************************************
+ * Pool of warm streamers
+ */
+
+static uint32_t elapsed(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+streamerPool::streamerPool(factory make, size_t depth) : make(make), depth(depth) {
+    thread = std::thread(&streamerPool::run, this);
+}
+
+streamerPool::~streamerPool(void) {
+    {
+        std::scoped_lock lock(mutex);
+        running = false;
+    }
+    wake.notify_one();
+    // at worst, we wait for the streamer being prepared
+    thread.join();
+}
+
+std::shared_ptr<HTTPstreamer> streamerPool::get(void) {
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<HTTPstreamer> streamer;
+    {
+        std::scoped_lock lock(mutex);
+        if (!spares.empty()) {
+            streamer = spares.front();
+            spares.pop_front();
+        }
+        stalled = false;
+    }
+    wake.notify_one();
+
+    if (streamer) {
+        streamer->park(false);
+        CSPOT_LOG(info, "warm streamer ready in %u ms", elapsed(start));
+    } else {
+        // cold start when pool was empty (first track or back-to-back changes)
+        streamer = make();
+        CSPOT_LOG(info, "cold streamer ready in %u ms", elapsed(start));
+    }
+
+    return streamer;
+}
+
+void streamerPool::run(void) {
+    std::unique_lock lock(mutex);
+
+    while (true) {
+        wake.wait(lock, [this] { return !running || (!stalled && spares.size() < depth); });
+        if (!running) break;
+        lock.unlock();
+
+        // opening encoders takes time, so it's done without the lock
+        auto start = std::chrono::steady_clock::now();
+        std::shared_ptr<HTTPstreamer> streamer;
+        try {
+            streamer = make();
+            streamer->park(true);
+            CSPOT_LOG(info, "spare streamer prepared in %u ms", elapsed(start));
+        } catch (std::exception& e) {
+            CSPOT_LOG(error, "can't prepare streamer (%s)", e.what());
+        }
+
+        lock.lock();
+        if (streamer) spares.push_back(streamer);
+        else stalled = true;
+    }
+}
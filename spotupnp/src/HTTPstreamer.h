@@ -7,12 +7,20 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <inttypes.h>
+#include <errno.h>
 #include <map>
 #include <functional>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <deque>
 
-#include "BellTask.h"
 #include "TrackQueue.h"
 #ifdef _WIN32
 #include "win32shim.h"
@@ -21,6 +29,10 @@
 #include "HTTPmode.h"
 #include "metadata.h"
 #include "codecs.h"
+#include "memoryPool.h"
+#include "HTTPengine.h"
+#include "trackCache.h"
+#include "metrics.h"
 
 class HTTPstreamer;
 
@@ -29,14 +41,11 @@ typedef std::function<HTTPheaders(HTTPheaders)> onHeadersHandler;
 typedef std::function<void(HTTPstreamer *self)> EoSCallback;
 
 /****************************************************************************************
- * Cache buffer 
+ * Cache buffer (readers use their own absolute offset so that they can share it)
  */
 class cacheBuffer {
-private:
-    uint8_t* read_p, * write_p, * wrap_p;
-
 protected:
-    uint8_t* buffer;
+    uint8_t* buffer = NULL;
     size_t size;
 
 public:
@@ -45,83 +54,247 @@ public:
     cacheBuffer(size_t size) : size(size) { }
     virtual ~cacheBuffer(void) { };
     virtual size_t level(void) = 0;
-    virtual size_t pending(void) = 0;
+    size_t oldest(void) { return total - level(); }
+    // how far the newest data can be ahead of the oldest before it is overwritten
+    virtual size_t capacity(void) { return SIZE_MAX; }
     virtual ssize_t scope(size_t offset) = 0;
-    virtual size_t read(uint8_t* dst, size_t max, size_t min = 0) = 0;
-    virtual uint8_t* readInner(size_t& size) = 0;
-    virtual void setOffset(size_t offset) = 0;
+    virtual size_t read(size_t& offset, uint8_t* dst, size_t max) = 0;
     virtual void write(const uint8_t* src, size_t size) = 0;
     virtual void flush(void) = 0;
+    // zero-copy transmit to a socket, -1/ENOSYS when not available
+    virtual ssize_t sendTo(int sock, size_t& offset, size_t max) { errno = ENOSYS; return -1; }
+    // a parked buffer (not in use yet) does not take a share of memory budget
+    virtual void park(bool parked) { }
 };
 
 /****************************************************************************************
- * Ring buffer (always rolls over)
+ * Ring buffer made of memory pool's segments. It grows up to its fair share of memory
+ * budget (or size) and then rolls over. When the share goes down, the oldest segments go
+ * back to the pool as soon as the ring rolls over and the rest when it is flushed
  */
 class ringBuffer : public cacheBuffer {
 private:
-    uint8_t* read_p, * write_p, * wrap;
+    std::vector<uint8_t*> segments;
+    size_t maxSize;
+    // offset of data stored at the beginning of the ring, modulo its size
+    size_t phase = 0;
+    bool wrapped = false, parked = false;
+
+    void release(void);
+    void trim(void);
+    // what we may use once rolled over: at least a segment, at most our share
+    size_t allowed(void) { return std::max(std::min(maxSize, memoryPool::instance().share()) / memoryPool::segmentSize, (size_t) 1) * memoryPool::segmentSize; }
 
 public:
-    ringBuffer(size_t size = 8 * 1024 * 1024);
-    ~ringBuffer(void) { delete[] buffer; }
-    size_t level(void) { return total < size ? total : size - 1; }  
-    size_t pending(void) { return write_p >= read_p ? write_p - read_p : wrap - read_p; }
+    ringBuffer(size_t maxSize = SIZE_MAX);
+    ~ringBuffer(void);
+    size_t level(void) { return std::min(total, size); }
+    size_t capacity(void) { return wrapped ? std::min(size, allowed()) : std::min(maxSize, memoryPool::instance().share()); }
     ssize_t scope(size_t offset);
-    size_t read(uint8_t* dst, size_t max, size_t min = 0);
-    uint8_t* readInner(size_t& size);
-    void setOffset(size_t offset);
+    size_t read(size_t& offset, uint8_t* dst, size_t max);
     void write(const uint8_t* src, size_t size);
-    void flush(void) { read_p = write_p = buffer; total = 0; }
+    void flush(void) { release(); total = 0; }
+    void park(bool parked);
 };
 
 /****************************************************************************************
- * File buffer
+ * File buffer (memory-mapped file that grows as needed, stdio on Windows), can also be
+ * opened read-only on an existing file
  */
 class fileBuffer : public cacheBuffer {
 private:
     FILE* file;
-    size_t readOffset = 0;
+    bool readOnly = false;
+#ifndef _WIN32
+    int fd;
+    bool grow(size_t size);
+#endif
 
 public:
-    fileBuffer(size_t size = 128 * 1024) : cacheBuffer(size) { file = tmpfile(); buffer = new uint8_t[size]; }
-    ~fileBuffer(void) { fclose(file); delete[] buffer; }
+    fileBuffer(void);
+    fileBuffer(const std::string& path);
+    ~fileBuffer(void);
     size_t level(void) { return total; }
-    size_t pending(void) { return total - readOffset; }
     ssize_t scope(size_t offset) { return offset >= total ? offset - total + 1 : 0; }
-    size_t read(uint8_t* dst, size_t max, size_t min = 0);
-    uint8_t* readInner(size_t& size);
-    void setOffset(size_t offset) { readOffset = offset >= 0 ? offset : 0; }
+    size_t read(size_t& offset, uint8_t* dst, size_t max);
     void write(const uint8_t* src, size_t size);
-    void flush(void) { readOffset = total = 0; }
+    void flush(void) { if (!readOnly) total = 0; }
+    ssize_t sendTo(int sock, size_t& offset, size_t max);
 };
 
 /****************************************************************************************
- * Class to stream audio content with HTTP
+ * Index of encoded output position vs time, one entry per second is enough for seeking
  */
-class HTTPstreamer : public bell::Task {
+class timeIndex {
+private:
+    std::vector<std::pair<uint32_t, uint64_t>> entries;
+
+public:
+    void add(uint32_t ms, uint64_t offset) {
+        if (entries.empty() || ms >= entries.back().first + 1000) entries.emplace_back(ms, offset);
+    }
+    bool find(uint32_t ms, uint64_t& offset);
+    void clear(void) { entries.clear(); }
+};
+
+/****************************************************************************************
+ * HTTP request parsed in place (no allocation), only headers we care about are kept and
+ * views are valid as long as the parsed data is not modified
+ */
+class HTTPrequest {
+public:
+    enum { USER_AGENT, RANGE, ICY_METADATA, TRANSFER_MODE, CONTENT_FEATURES, SEEK_RANGE, CONNECTION, TIME_SEEK, MAX_HEADERS };
+    static constexpr const char* names[MAX_HEADERS] = { "user-agent", "range", "icy-metadata", "transferMode.dlna.org",
+                                                        "getcontentFeatures.dlna.org", "getAvailableSeekRange.dlna.org",
+                                                        "connection", "TimeSeekRange.dlna.org" };
+    std::string_view method, target, version, line;
+    std::string_view headers[MAX_HEADERS];
+
+    bool parse(const uint8_t* data, size_t size);
+    bool has(int index) { return headers[index].data() != NULL; }
+    bool keepAlive(void);
+    static size_t length(const uint8_t* data, size_t size);
+    static bool contains(std::string_view haystack, std::string_view needle);
+    static bool npt(std::string_view value, uint32_t& ms);
+};
+
+/****************************************************************************************
+ * HTTP response written in a fixed buffer (no allocation)
+ */
+class HTTPresponse {
+private:
+    char buffer[2048];
+    size_t length = 0;
+
+public:
+    void status(const char* version, const char* status) { length = 0; add("%s %s\r\n", version, status); }
+    void add(const char* format, ...);
+    void header(const char* name, const char* format, ...);
+    void end(void) { add("\r\n"); }
+    const char* data(void) { return buffer; }
+    size_t size(void) { return length; }
+};
+
+/****************************************************************************************
+ * Shared HTTP server (one per interface) that routes requests to streamers using their id
+ * and also answers /metrics
+ */
+class HTTPserver {
+private:
+    std::mutex mutex;
+    int listenSock = -1;
+    uint16_t port;
+    std::map<std::string, std::weak_ptr<HTTPstreamer>> streamers;
+    std::map<int, std::vector<uint8_t>> incoming;
+
+    void onAccept(int sock, uint32_t events);
+    void onRequest(int sock, uint32_t events);
+    void reject(int sock, const char* status);
+    void metricsReply(int sock);
+
+public:
+    inline static uint16_t portBase = 0, portRange = 1;
+
+    HTTPserver(struct in_addr addr);
+    static std::shared_ptr<HTTPserver> get(struct in_addr addr);
+    uint16_t getPort(void) { return port; }
+    void attach(std::string id, std::weak_ptr<HTTPstreamer> streamer);
+    void detach(std::string id);
+};
+
+/****************************************************************************************
+ * Class to stream audio content with HTTP (sockets are served by the HTTPengine)
+ */
+class HTTPstreamer : public std::enable_shared_from_this<HTTPstreamer> {
 private:
     std::atomic<bool> isRunning = false;
-    std::mutex runningMutex;
+    std::mutex mutex;
     std::string host;
     std::string streamUrl;
-    int listenSock = -1;
+    std::shared_ptr<HTTPserver> server;
     uint16_t port;
-    int64_t contentLength = HTTP_CL_NONE;
-    std::unique_ptr<baseCodec> encoder;
+    int64_t contentLength = HTTP_CL_NONE, lengthMode = HTTP_CL_NONE;
+    std::string codec, mimeType;
+    std::shared_ptr<baseCodec> encoder;
     std::unique_ptr<cacheBuffer> cache;
-    size_t useCache, scratchLen;
+    size_t scratchLen;
     uint8_t *scratch;
-    bool flow, chunked;
+    bool flow, zeroCopy = true;
     int cacheMode;
-    struct {
-        size_t interval, remain;
-        size_t size, count;
-        std::string trackId;
-    } icy;
-
-    void runTask();
-    ssize_t streamBody(int sock, struct timeval& timeout);
-    ssize_t sendChunk(int sock, uint8_t* data, ssize_t size, bool count);
+    // set when clients wait for encoder, producer then wakes us up past the watermark
+    std::atomic<bool> starving = false;
+    // encoder has output everything after being drained
+    bool exhausted = false;
+    size_t watermark;
+    std::string DLNAfeatures;
+    HTTPresponse response;
+    timeIndex index;
+    // track being written to persistent cache or, when served from it, its size (no encoder then)
+    std::unique_ptr<trackCache::writer> store;
+    uint64_t stored = 0;
+    std::atomic<size_t> servedMax = 0;
+    std::shared_ptr<streamMetrics> stats;
+    std::string id;
+    std::chrono::steady_clock::time_point loaded;
+    bool served = false;
+    // decoder waiting for that much PCM credit (0 when none)
+    std::condition_variable creditCond;
+    size_t credited = 0;
+    static const size_t resumeCredit = 64 * 1024;
+    // pacing: ms of audio sent at once, then % of real-time (0 is as fast as possible)
+    uint32_t burst = 0, rate = 0, byteRate = 0;
+
+    // each client has its own cursor in the cache and its own output queue
+    struct connection {
+        int sock;
+        size_t cursor = 0;
+        std::vector<uint8_t> request, framing;
+        std::unique_ptr<uint8_t[]> scratch;
+        struct segment {
+            const uint8_t* data;
+            size_t offset, size;
+        };
+        std::vector<segment> pending;
+        size_t pendingPos = 0, pendingSent = 0;
+        uint64_t sendCalls = 0, sendBytes = 0;
+        // sent but not acknowledged by renderer yet (still in socket)
+        size_t queued = 0;
+        bool body = false, chunked = false, closing = false, stalled = false, keepAlive = false;
+        struct {
+            size_t interval = 0, remain;
+            std::string trackId;
+        } icy;
+        struct {
+            std::chrono::steady_clock::time_point start;
+            uint64_t sent = 0;
+            bool paused = false;
+            // last time client took something, to know if it is still reading
+            std::chrono::steady_clock::time_point active;
+        } pace;
+        connection(int sock) : sock(sock) { }
+    };
+    std::map<int, std::unique_ptr<connection>> connections;
+    // a renderer may open a probe next to its stream, and all renderers of a group read the same stream
+    static const size_t maxConnections = 32;
+
+    void onEvent(int sock, uint32_t events);
+    void onWake(void);
+    void wake(bool force = false);
+    bool onRequest(connection& conn);
+    bool connect(connection& conn, HTTPrequest& request);
+    void pump(connection& conn);
+    void closeSocket(connection& conn, const char* reason);
+    bool sendPending(connection& conn);
+    void queue(connection& conn, const uint8_t* data, size_t size, bool copy = false);
+    size_t produce(void);
+    ssize_t streamBody(connection& conn);
+    size_t allowance(connection& conn);
+    bool headroom(connection& conn);
+    size_t backlog(void);
+    size_t available(void);
+    void offload(void);
+    void notifyCredit(bool force = false);
+    ssize_t sendChunk(connection& conn, uint8_t* data, ssize_t size, bool copy = false);
     void getMetadata(cspot::TrackInfo& track, metadata_t* metadata);
     onHeadersHandler onHeaders;
     EoSCallback onEoS;
@@ -133,19 +306,59 @@ public:
     cspot::TrackInfo trackInfo;
     std::string trackUnique;
     int64_t offset;
-    inline static uint16_t portBase = 0, portRange = 1;
-    uint64_t totalIn = 0, totalOut = 0;
+    std::atomic<uint64_t> totalIn = 0;
+    uint64_t totalOut = 0;
 
-    HTTPstreamer(struct in_addr addr, std::string id, unsigned index, std::string codec, 
+    HTTPstreamer(struct in_addr addr, std::string id, std::string codec, 
                  bool flow, int64_t contentLength, int cacheMode,
-                 cspot::TrackInfo track, std::string_view trackUnique, int32_t startOffset,
                  onHeadersHandler onHeaders, EoSCallback onEoS);
     ~HTTPstreamer();
+    void load(unsigned index, cspot::TrackInfo track, std::string_view trackUnique, int32_t startOffset);
+    void start(void);
+    void accept(int sock, std::vector<uint8_t>& request);
     void flush(void);
-    bool connect(int sock);
+    void drain(void);
+    void useTrackCache(std::string_view source);
+    void park(bool parked);
+    void setPacing(uint32_t burst, uint32_t rate);
     bool feedPCMFrames(const uint8_t* data, size_t size);
+    size_t credit(void);
+    bool waitCredit(size_t size, uint32_t timeout);
     std::string getStreamUrl(void) { return streamUrl; }
     void getMetadata(metadata_t* metadata);
     void setContentLength(int64_t contentLength);
     std::string trackId() { return trackInfo.trackId; }
 };
+
+/****************************************************************************************
+ * Keeps a few streamers ready for a player so that a track change only has to load the
+ * track instead of opening an encoder and allocating buffers in the critical path. Pool
+ * has its own thread that refills it after each get(), so that opening encoders never 
+ * holds encoding jobs, and spares are parked so that they don't reduce memory share of 
+ * active streams.
+ * A streamer is never reset for another track because once used, it can still be 
+ * referenced (clients re-opening its url, group followers, posted callbacks). It would 
+ * not be cheaper either: a used encoder has written its headers and drained, so it must
+ * be re-opened, and buffers hold no memory of their own (it's in the memory pool). A fresh
+ * spare is what a reset streamer would be, and get() only has to un-park it
+ */
+class streamerPool {
+public:
+    typedef std::function<std::shared_ptr<HTTPstreamer>()> factory;
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::shared_ptr<HTTPstreamer>> spares;
+    factory make;
+    size_t depth;
+    // don't retry a failed preparation until next get()
+    bool running = true, stalled = false;
+    std::thread thread;
+    void run(void);
+
+public:
+    streamerPool(factory make, size_t depth = 1);
+    ~streamerPool(void);
+    std::shared_ptr<HTTPstreamer> get(void);
+};
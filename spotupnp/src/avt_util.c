@@ -32,6 +32,7 @@ bool SubmitTransportAction(struct sMR *Device, IXML_Document *ActionNode) {
 
 	if (!Device->WaitCookie) {
 		Device->WaitCookie = Device->seqN++;
+		Device->WaitStamp = gettime_ms();
 		rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
 								 NULL, ActionNode, ActionHandler, Device->WaitCookie);
 
@@ -8,6 +8,8 @@
 #include <cassert>
 #include <cstdint>
 #include <cstring>
+#include <array>
+#include <deque>
 #include "Logger.h"
 #include "spotify.h"
 #include "metadata.h"
@@ -17,6 +19,8 @@
 #endif
 
 #include "codecs.h"
+#include "encoderPool.h"
+#include "sampleKernels.h"
 #include "FLAC/stream_encoder.h"
 #include "opusenc.h"
 #include "vorbis/vorbisfile.h"
@@ -31,68 +35,98 @@ extern "C" {
  */
 
 byteBuffer::byteBuffer(FILE* storage, size_t size) {
-    buffer = new uint8_t[size];
-    this->size = size;
-    this->write_p = this->read_p = buffer;
-    this->wrap_p = buffer + size; 
+    this->size = (size + memoryPool::segmentSize - 1) / memoryPool::segmentSize * memoryPool::segmentSize;
+    // data spans one more segment than size when it does not start on a boundary
+    count = this->size / memoryPool::segmentSize + 1;
+    segments = std::make_unique<std::atomic<uint8_t*>[]>(count);
+    for (size_t i = 0; i < count; i++) segments[i] = NULL;
     this->storage = storage;
+    memoryPool::instance().join();
 }
 
 byteBuffer::~byteBuffer(void) { 
-    std::scoped_lock lock(mutex); 
-    delete[] buffer;
+    for (size_t i = 0; i < count; i++) {
+        if (segments[i]) memoryPool::instance().release(segments[i]);
+    }
+    if (spare) memoryPool::instance().release(spare);
+    if (!parked) memoryPool::instance().leave();
     if (storage) fclose(storage);
 }
 
+void byteBuffer::park(bool parked) {
+    if (parked == this->parked) return;
+    this->parked = parked;
+    if (parked) memoryPool::instance().leave();
+    else memoryPool::instance().join();
+    // buffer is not used when parked, so its spare is of no use to anybody
+    if (auto data = parked ? spare.exchange(NULL) : NULL) memoryPool::instance().release(data);
+}
+
+void byteBuffer::advance(size_t tail) {
+    // a spare is only kept if it fits in our share (which shrinks when buffers are added)
+    bool keep = head.load(std::memory_order_acquire) - tail + 2 * memoryPool::segmentSize <= capacity();
+
+    // segments fully read are released *before* producer can see they are free
+    for (size_t pos = this->tail.load(std::memory_order_relaxed); pos / memoryPool::segmentSize < tail / memoryPool::segmentSize; 
+         pos = (pos / memoryPool::segmentSize + 1) * memoryPool::segmentSize) {
+        uint8_t* data = segment(pos).exchange(NULL, std::memory_order_relaxed);
+        if (!data) continue;
+        uint8_t* none = NULL;
+        if (!keep || !spare.compare_exchange_strong(none, data, std::memory_order_release)) memoryPool::instance().release(data);
+    }
+    this->tail.store(tail, std::memory_order_release);
+}
+
 size_t byteBuffer::read(uint8_t* dst, size_t size, size_t min) {
-    std::scoped_lock lock(mutex);
-    size = std::min(size, _used());
+    size_t tail = this->tail.load(std::memory_order_relaxed);
+    size = std::min(size, head.load(std::memory_order_acquire) - tail);
     if (size < min) return 0;
 
-    size_t cont = std::min(size, (size_t) (wrap_p - read_p));
-    memcpy(dst, read_p, cont);
-    memcpy(dst + cont, buffer, size - cont);
+    for (size_t done = 0; done < size;) {
+        size_t pos = (tail + done) % memoryPool::segmentSize;
+        size_t cont = std::min(size - done, memoryPool::segmentSize - pos);
+        memcpy(dst + done, segment(tail + done).load(std::memory_order_relaxed) + pos, cont);
+        done += cont;
+    }
 
-    read_p += size;
-    if (read_p >= wrap_p) read_p -= this->size;
+    advance(tail + size);
     return size;
 }
 
 uint8_t* byteBuffer::readInner(size_t &size) {
-    // unless there is no enough data, we exit with mutex locked
-    mutex.lock();
+    size_t tail = this->tail.load(std::memory_order_relaxed);
+    size_t pos = tail % memoryPool::segmentSize;
 
     // 0 means we want everything (contiguous)
     if (!size) size = this->size;
 
-    // caller *must* consume ALL data
-    size = std::min(size, _used());
-    size = std::min(size, (size_t)(wrap_p - read_p));
-
-    if (!size) {
-        mutex.unlock();
-        return NULL;
-    }
+    // caller *must* consume() what it uses
+    size = std::min(size, head.load(std::memory_order_acquire) - tail);
+    size = std::min(size, memoryPool::segmentSize - pos);
 
-    uint8_t* r = read_p; 
-    read_p += size;
-    if (read_p >= wrap_p) read_p -= this->size;
-    
-    return r;
+    return size ? segment(tail).load(std::memory_order_relaxed) + pos : NULL;
 }
 
 bool byteBuffer::write(const uint8_t* src, size_t size) {
-    std::scoped_lock lock(mutex);
-    if (size > _space()) return false;
-
-    size_t cont = std::min(size, (size_t)(wrap_p - write_p));
-    memcpy(write_p, src, cont);
-    memcpy(buffer, src + cont, size - cont);
+    size_t head = this->head.load(std::memory_order_relaxed);
+    if (size > space()) return false;
+
+    for (size_t done = 0; done < size;) {
+        size_t pos = (head + done) % memoryPool::segmentSize;
+        size_t cont = std::min(size - done, memoryPool::segmentSize - pos);
+        auto& slot = segment(head + done);
+        // consumer has released that slot when we see it as free, reuse what it handed over if any
+        if (!slot.load(std::memory_order_relaxed)) {
+            uint8_t* data = spare.exchange(NULL, std::memory_order_acquire);
+            slot.store(data ? data : memoryPool::instance().acquire(), std::memory_order_relaxed);
+        }
+        memcpy(slot.load(std::memory_order_relaxed) + pos, src + done, cont);
+        done += cont;
+    }
 
     if (storage) fwrite(src, size, 1, storage);
 
-    write_p += size;
-    if (write_p >= wrap_p) write_p -= this->size;
+    this->head.store(head + size, std::memory_order_release);
     return true;
 }
 
@@ -128,13 +162,107 @@ baseCodec::baseCodec(codecSettings settings, std::string mimeType, bool store) :
     encoded = pcm;
 }
 
+bool baseCodec::prepare(void) {
+    std::scoped_lock lock(encoding);
+    if (!ready) ready = open();
+    return ready;
+}
+
+int64_t baseCodec::initialize(int64_t duration) {
+    // encoder might have been opened ahead of time, but it's only good for one track
+    if (!prepare()) return 0;
+    std::scoped_lock lock(encoding);
+    ready = false;
+    return start(duration);
+}
+
+void baseCodec::flush(void) {
+    std::scoped_lock lock(encoding);
+    total = 0; 
+    ready = false; 
+    pcm->flush(); 
+    encoded->flush();
+    finishing = finished = false;
+    // offsets of next track start from here
+    std::scoped_lock sync(syncMutex);
+    syncPoints.clear();
+    nextMark = 0;
+    origin = encoded->written();
+}
+
+void baseCodec::mark(uint64_t position) {
+    std::scoped_lock lock(syncMutex);
+    // time index only keeps one entry per second anyway
+    if (position < nextMark) return;
+    syncPoints.emplace_back(position, encoded->written() - origin);
+    nextMark = position + pcmBitrate / 8;
+}
+
+bool baseCodec::syncPoint(uint64_t limit, uint64_t& position, uint64_t& offset) {
+    std::scoped_lock lock(syncMutex);
+    if (syncPoints.empty() || syncPoints.front().second >= limit) return false;
+    position = syncPoints.front().first;
+    offset = syncPoints.front().second;
+    syncPoints.pop_front();
+    return true;
+}
+
+void baseCodec::offload(std::function<void()> onEncoded) {
+    // only codecs that encode when reading or in parallel have something to offload (codec must be shared)
+    if ((pcm == encoded && !parallel) || weak_from_this().expired()) return;
+    this->onEncoded = onEncoded;
+    async = pcm != encoded;
+}
+
+bool baseCodec::pcmWrite(const uint8_t* data, size_t size) { 
+    if (!pcm->write(data, size)) return false;
+    if (async) schedule();
+    return true;
+}
+
+void baseCodec::schedule(void) {
+    // only one job in flight per codec, others are just counted
+    if (requests.fetch_add(1) == 0) {
+        encoderPool::instance().submit([self = weak_from_this()] {
+            if (auto codec = self.lock()) codec->encode();
+        });
+    }
+}
+
+void baseCodec::encode(void) {
+    uint32_t served = requests.load();
+    bool more, ended = false;
+    {
+        std::scoped_lock lock(encoding);
+        more = process(jobBudget);
+        // encoder's tail goes out once reader has taken the rest, then reader is told it's over
+        if (finishing && !finished && !more && !encoded->used()) {
+            finish();
+            ended = finished;
+        }
+    }
+    if (onEncoded && (encoded->used() || ended)) onEncoded();
+    // go again, at the end of the queue, if requests came in meanwhile or budget was not enough
+    if (served -= more; requests.fetch_sub(served) != served) {
+        encoderPool::instance().submit([self = weak_from_this()] {
+            if (auto codec = self.lock()) codec->encode();
+        });
+    }
+}
+
 size_t baseCodec::read(uint8_t* dst, size_t size, size_t min, bool drain) { 
-    // we want to encode more than required but not too much to leave some CPU
-    process(size * 2);
+    if (!async) {
+        // we want to encode more than required but not too much to leave some CPU
+        process(size * 2);
+    } else if (pcm->used() || (drain && !finished)) {
+        // reading makes room for encoder and, when draining, pool flushes its tail
+        if (drain) finishing = true;
+        schedule();
+    }
     size_t bytes = encoded->read(dst, size, min);
 
-    if (!bytes && drain) {
-        baseCodec::drain();
+    if (!bytes && drain && !async) {
+        finish();
         return encoded->read(dst, size, min);
     } else {
         return bytes;
@@ -142,12 +270,17 @@ size_t baseCodec::read(uint8_t* dst, size_t size, size_t min, bool drain) {
 }
 
 uint8_t* baseCodec::readInner(size_t& size, bool drain) { 
-    // we want to encode more than required but not too much to leave some CPU
-    process(size * 2);
+    if (!async) {
+        // we want to encode more than required but not too much to leave some CPU
+        process(size * 2);
+    } else if (pcm->used() || (drain && !finished)) {
+        if (drain) finishing = true;
+        schedule();
+    }
     uint8_t * data = encoded->readInner(size);
 
-    if (!data && drain) {
-        baseCodec::drain();
+    if (!data && drain && !async) {
+        finish();
         return encoded->readInner(size);
     } else {
         return data;
@@ -166,9 +299,14 @@ std::string baseCodec::id(void) {
  */
 
 class pcmCodec : public::baseCodec {
+private:
+    uint64_t position = 0;
+
 public:
     pcmCodec(codecSettings settings, bool store = false);
-    virtual int64_t initialize(int64_t duration) { return duration ? (((int64_t)pcmBitrate * duration) / (8 * 1000)) & ~1LL : -INT64_MAX; }
+    virtual bool open(void) { position = 0; return true; }
+    virtual int64_t start(int64_t duration) { return duration ? (((int64_t)pcmBitrate * duration) / (8 * 1000)) & ~1LL : -INT64_MAX; }
+    virtual bool pcmWrite(const uint8_t* data, size_t size);
     virtual size_t read(uint8_t* dst, size_t size, size_t min, bool drain);
     virtual uint8_t* readInner(size_t& size, bool drain);
 };
@@ -180,38 +318,36 @@ pcmCodec::pcmCodec(codecSettings settings, bool store) :
                ";channels=" + std::to_string(settings.channels);
 }
 
+bool pcmCodec::pcmWrite(const uint8_t* data, size_t size) {
+    // decoding can start at any sample
+    mark(position);
+    if (!baseCodec::pcmWrite(data, size)) return false;
+    position += size;
+    return true;
+}
+
 uint8_t* pcmCodec::readInner(size_t& size, bool drain) {
     uint8_t* data = pcm->readInner(size);
 
-    // will only locked if not empty
-    if (!size) return NULL;
+    // data is swapped in place so caller *must* consume all of it
+    if (!size) {
+        if (drain) finish();
+        return NULL;
+    }
 
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     // pcm needs byte swapping on little endian CPU
-    uint16_t* swap = (uint16_t*)data;
-    for (size_t i = size / settings.size; i; i--) {
-#ifdef _WIN32
-        * swap++ = _byteswap_ushort(*swap);
-#else
-        * swap++ = __builtin_bswap16(*swap);
-#endif
-    }
+    sampleKernels::get().byteswap16((uint16_t*) data, size / settings.size);
 #endif
     return data;
 }
 
 size_t pcmCodec::read(uint8_t* dst, size_t size, size_t min, bool drain) {
     size_t bytes = encoded->read(dst, size, min);
+    if (!bytes && drain) finish();
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
     // pcm needs byte swapping on little endian CPU
-    uint16_t* swap = (uint16_t*) dst;
-    for (int i = bytes / settings.size; i; i--) {
-#ifdef _WIN32
-        * swap++ = _byteswap_ushort(*swap);
-#else
-        * swap++ = __builtin_bswap16(*swap);
-#endif
-    }
+    sampleKernels::get().byteswap16((uint16_t*) dst, bytes / settings.size);
 #endif
     return bytes;
 }
@@ -222,14 +358,34 @@ size_t pcmCodec::read(uint8_t* dst, size_t size, size_t min, bool drain) {
 
 class wavCodec : public::baseCodec {
 private:
-    size_t position = 0;
+    uint64_t position = 0;
 
 public:
     wavCodec(codecSettings settings, bool store = false) : baseCodec(settings, "audio/wav", store) { icyInterval = 128 * 1024; }
-    virtual int64_t initialize(int64_t duration);
+    virtual bool open(void) { position = 0; return true; }
+    virtual int64_t start(int64_t duration);
+    virtual bool pcmWrite(const uint8_t* data, size_t size);
+    virtual void patchHeader(uint8_t* data, size_t size, uint64_t length, uint64_t pcm);
 };
 
-int64_t wavCodec::initialize(int64_t duration) {
+void wavCodec::patchHeader(uint8_t* data, size_t size, uint64_t length, uint64_t pcm) {
+    // RIFF and data chunk sizes are set from duration by start(), whatever CPU endianness is
+    if (size < 44 || length < 44 || memcmp(data, "RIFF", 4) || memcmp(data + 36, "data", 4)) return;
+    uint32_t payload = std::min(length - 44, (uint64_t) UINT32_MAX - 36);
+    auto le32 = [](uint8_t* p, uint32_t v) { for (int i = 0; i < 4; i++) p[i] = v >> (i * 8); };
+    le32(data + 4, 36 + payload);
+    le32(data + 40, payload);
+}
+
+bool wavCodec::pcmWrite(const uint8_t* data, size_t size) {
+    // after header, decoding can start at any sample
+    mark(position);
+    if (!baseCodec::pcmWrite(data, size)) return false;
+    position += size;
+    return true;
+}
+
+int64_t wavCodec::start(int64_t duration) {
     struct PACK(header {
         uint8_t	 chunkId[4];
         uint32_t chunkSize;
@@ -285,22 +441,83 @@ int64_t wavCodec::initialize(int64_t duration) {
 
 class flacCodec : public::baseCodec {
 private:
+    // parallel mode: a batch of blocks encoded in the pool as a stream of its own
+    struct batch {
+        FLAC__StreamEncoder* flac = NULL;
+        std::vector<FLAC__int32> samples;
+        std::vector<uint8_t> frames;
+        size_t count = 0;
+        unsigned blocksize = 0;
+        uint64_t first = 0;
+        uint32_t generation = 0;
+        bool done = false;
+    };
+
     FLAC__StreamEncoder* flac = NULL;
     bool drained = false;
+    // widened samples waiting to make a full block, allocated once and reused
+    std::vector<FLAC__int32> staging;
+    std::atomic<size_t> staged = 0;
+    size_t blockSamples = 0;
+    static constexpr size_t stagingBlocks = 4;
+
+    // batches are filled in turn, encoded by pool's workers and their frames are renumbered 
+    // and written in order. Main encoder only writes the stream header
+    std::vector<std::unique_ptr<batch>> batches;
+    std::deque<batch*> idle, running;
+    batch* filling = NULL;
+    std::mutex parallelMutex;
+    std::atomic<size_t> inflight = 0;
+    uint64_t frames = 0;
+    uint32_t generation = 0;
+    static constexpr size_t batchBlocks = 4, maxBatches = 8;
+
+    bool configure(FLAC__StreamEncoder* encoder, unsigned blocksize);
+    void feed(bool all = false);
+    void reset(void);
+    bool parallelWrite(const int16_t* samples, size_t count);
+    batch* submit(void);
+    void dispatch(batch* batch);
+    void encodeBatch(batch* batch);
+    void stitch(batch* batch);
 
 public:
-    flacCodec(codecSettings settings, bool store = false) : baseCodec(settings, "audio/flac", store) { icyInterval = 128 * 1024; }
+    flacCodec(codecSettings settings, bool store = false);
     virtual ~flacCodec(void);
-    virtual int64_t initialize(int64_t duration);
+    virtual bool open(void);
+    virtual int64_t start(int64_t duration);
+    virtual uint32_t bitrate(void) { return pcmBitrate * ratio[settings.flac.level]; }
     virtual bool pcmWrite(const uint8_t* data, size_t size);
-    virtual void drain(void);
+    virtual size_t credit(void);
+    virtual void flush(void);
+    virtual bool drain(void);
+    virtual void patchHeader(uint8_t* data, size_t size, uint64_t length, uint64_t pcm);
+    static constexpr double ratio[] = { 0.8, 0.79, 0.78, 0.75, 0.72, 0.71, 0.70, 0.68, 0.65 };
 };
 
+flacCodec::flacCodec(codecSettings settings, bool store) : baseCodec(settings, "audio/flac", store) { 
+    icyInterval = 128 * 1024; 
+    parallel = settings.flac.parallel;
+}
+
 flacCodec::~flacCodec(void) {
     if (flac) FLAC__stream_encoder_delete((FLAC__StreamEncoder*)flac);
+    // jobs hold a reference on us, so none is running
+    for (auto& batch : batches) FLAC__stream_encoder_delete(batch->flac);
+}
+
+bool flacCodec::configure(FLAC__StreamEncoder* encoder, unsigned blocksize) {
+    FLAC__bool ok = FLAC__stream_encoder_set_verify(encoder, false);
+    ok &= FLAC__stream_encoder_set_compression_level(encoder, settings.flac.level);
+    ok &= FLAC__stream_encoder_set_channels(encoder, settings.channels);
+    ok &= FLAC__stream_encoder_set_bits_per_sample(encoder, settings.size * 8);
+    ok &= FLAC__stream_encoder_set_sample_rate(encoder, settings.rate);
+    ok &= FLAC__stream_encoder_set_blocksize(encoder, blocksize);
+    ok &= FLAC__stream_encoder_set_streamable_subset(encoder, true);
+    return ok;
 }
 
-int64_t flacCodec::initialize(int64_t duration) {
+bool flacCodec::open(void) {
     // clean any current decoder 
     if (flac) FLAC__stream_encoder_delete((FLAC__StreamEncoder*)flac);
     drained = false;
@@ -313,37 +530,297 @@ int64_t flacCodec::initialize(int64_t duration) {
 
     flac = FLAC__stream_encoder_new();
 
-    FLAC__bool ok = FLAC__stream_encoder_set_verify(flac, false);
-    ok &= FLAC__stream_encoder_set_compression_level(flac, settings.flac.level);
-    ok &= FLAC__stream_encoder_set_channels(flac, settings.channels);
-    ok &= FLAC__stream_encoder_set_bits_per_sample(flac, settings.size * 8);
-    ok &= FLAC__stream_encoder_set_sample_rate(flac, settings.rate);
-    ok &= FLAC__stream_encoder_set_blocksize(flac, 0);
-    ok &= FLAC__stream_encoder_set_streamable_subset(flac, true);
+    FLAC__bool ok = configure(flac, 0);
     ok &= !FLAC__stream_encoder_init_stream(flac, flacWrite, NULL, NULL, NULL, this);
 
     if (!ok) throw std::runtime_error("Cannot set FLAC parameters");
 
-    double ratio[] = { 0.8, 0.79, 0.78, 0.75, 0.72, 0.71, 0.70, 0.68, 0.65 };
+    // blocksize is only known once encoder is initialized (depends on level)
+    blockSamples = FLAC__stream_encoder_get_blocksize(flac) * settings.channels;
+    staging.resize(blockSamples * stagingBlocks);
+    staged = 0;
+
+    if (parallel) {
+        reset();
+        std::scoped_lock lock(parallelMutex);
+        // one batch per worker and one being filled, all allocated once
+        for (size_t i = batches.size(); i < std::min(encoderPool::instance().size() + 1, maxBatches); i++) {
+            auto batch = std::make_unique<flacCodec::batch>();
+            batch->flac = FLAC__stream_encoder_new();
+            batch->samples.resize(blockSamples * batchBlocks);
+            // frames can be a bit larger than PCM when it can't be compressed
+            batch->frames.reserve(batch->samples.size() * settings.size + batchBlocks * 64);
+            idle.push_back(batch.get());
+            batches.push_back(std::move(batch));
+        }
+    }
+
+    return true;
+}
+
+void flacCodec::patchHeader(uint8_t* data, size_t size, uint64_t length, uint64_t pcm) {
+    /* Encoder can't seek back in its output so STREAMINFO has 0 (unknown) total samples. It's
+     * the first metadata block and that 36 bits field starts in the low nibble of byte 21 */
+    if (size < 26 || memcmp(data, "fLaC", 4) || (data[4] & 0x7f)) return;
+    uint64_t samples = std::min<uint64_t>(pcm / (settings.channels * settings.size), (1ULL << 36) - 1);
+    data[21] = (data[21] & 0xf0) | (samples >> 32);
+    for (int i = 0; i < 4; i++) data[22 + i] = samples >> ((3 - i) * 8);
+}
+
+int64_t flacCodec::start(int64_t duration) {
     return -(duration ? (pcmBitrate * duration * ratio[settings.flac.level]) / (8 * 1000) : INT64_MAX);
 }
 
+size_t flacCodec::credit(void) {
+    if (parallel) {
+        // room in output for what is in flight (frames are at most PCM size) and in batches
+        size_t space = encoded->space(), reserved = inflight + minSpace;
+        std::scoped_lock lock(parallelMutex);
+        size_t room = idle.size() * blockSamples * batchBlocks + (filling ? filling->samples.size() - filling->count : 0);
+        return std::min(space > reserved ? space - reserved : 0, room * settings.size);
+    }
+
+    // what is staged will be encoded with next write, so it takes its share of room
+    size_t space = encoded->space(), pending = staged * settings.size;
+    return space >= minSpace && space / 2 > pending ? space / 2 - pending : 0;
+}
+
 bool flacCodec::pcmWrite(const uint8_t* data, size_t len) {
-    if (encoded->space() < std::max(len * 2, minSpace)) return false;
+    if (parallel) return parallelWrite((const int16_t*) data, len / settings.size);
+    if (encoded->space() < std::max((len + staged * settings.size) * 2, minSpace)) return false;
     //assert((size & 0x03) != 0);
 
-    auto flacSamples = new FLAC__int32[len];
-    for (size_t i = 0; i < len / settings.size; i++, data += settings.size) flacSamples[i] = *(int16_t*)data;
-    FLAC__stream_encoder_process_interleaved((FLAC__StreamEncoder*)flac, flacSamples, len / (settings.size * settings.channels));
-    delete[] flacSamples;
+    // stage as much as fits and encode all full blocks, no allocation whatever len is
+    auto samples = (const int16_t*) data;
+    for (size_t count = len / settings.size; count;) {
+        size_t chunk = std::min(count, staging.size() - staged);
+        sampleKernels::get().widen16(samples, staging.data() + staged, chunk);
+        samples += chunk;
+        count -= chunk;
+        staged += chunk;
+        feed();
+    }
 
     return true;
 }
 
-void flacCodec::drain(void) {
-    if (drained) return;
-    FLAC__stream_encoder_finish((FLAC__StreamEncoder*)flac);
+void flacCodec::feed(bool all) {
+    size_t samples = all ? staged.load() : staged / blockSamples * blockSamples;
+    if (!samples) return;
+
+    FLAC__stream_encoder_process_interleaved((FLAC__StreamEncoder*)flac, staging.data(), samples / settings.channels);
+
+    // keep the start of next block at the beginning
+    std::copy(staging.begin() + samples, staging.begin() + staged, staging.begin());
+    staged -= samples;
+}
+
+void flacCodec::flush(void) {
+    if (parallel) reset();
+    baseCodec::flush();
+}
+
+bool flacCodec::drain(void) {
+    if (drained) return drained;
+
+    if (parallel) {
+        std::unique_lock lock(parallelMutex);
+        if (filling && filling->count) {
+            auto batch = submit();
+            lock.unlock();
+            dispatch(batch);
+            lock.lock();
+        }
+        // not done until all frames are in output, stitch() wakes up reader when they are
+        if (!running.empty()) return false;
+    } else {
+        feed(true);
+        FLAC__stream_encoder_finish((FLAC__StreamEncoder*)flac);
+    }
+
     drained = true;
+    return true;
+}
+
+/* 
+ Frame-parallel encoding. FLAC frames only depend on their own samples, so a batch of 
+ blocks can be encoded as a separate stream and its frames appended to the main one, once
+ their number is fixed (it is in frame header, which changes its length and both CRCs)
+ */
+
+static uint8_t flacCRC8(const uint8_t* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint8_t, 256> table;
+        for (int i = 0; i < 256; i++) {
+            uint8_t crc = i;
+            for (int bit = 0; bit < 8; bit++) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+            table[i] = crc;
+        }
+        return table;
+    }();
+    uint8_t crc = 0;
+    for (; size; size--) crc = table[crc ^ *data++];
+    return crc;
+}
+
+static uint16_t flacCRC16(const uint8_t* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint16_t, 256> table;
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = i << 8;
+            for (int bit = 0; bit < 8; bit++) crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+            table[i] = crc;
+        }
+        return table;
+    }();
+    uint16_t crc = 0;
+    for (; size; size--) crc = (crc << 8) ^ table[(crc >> 8) ^ *data++];
+    return crc;
+}
+
+static void flacRenumber(const uint8_t* frame, size_t size, uint64_t number, std::vector<uint8_t>& out) {
+    // frame number is UTF-8 coded after 4 fixed bytes, its length is the count of leading 1s 
+    size_t len = 0;
+    for (uint8_t c = frame[4]; c & 0x80; c <<= 1) len++;
+    len = std::max(len, (size_t) 1);
+
+    // then come optional blocksize and sample rate, then CRC-8 of header
+    uint8_t blocksize = frame[2] >> 4, rate = frame[2] & 0x0f;
+    size_t extra = (blocksize == 6 ? 1 : blocksize == 7 ? 2 : 0) + (rate == 12 ? 1 : rate == 13 || rate == 14 ? 2 : 0);
+    const uint8_t* body = frame + 4 + len + extra + 1;
+
+    size_t start = out.size();
+    out.resize(start + size + 6);
+    uint8_t* p = out.data() + start;
+
+    memcpy(p, frame, 4);
+    uint8_t* coded = p + 4;
+    if (number < 0x80) {
+        *coded++ = number;
+    } else {
+        int bytes = number < 0x800 ? 2 : number < 0x10000 ? 3 : number < 0x200000 ? 4 : 
+                    number < 0x4000000 ? 5 : number < 0x80000000 ? 6 : 7;
+        *coded++ = (0xff00 >> bytes) | (number >> (6 * (bytes - 1)));
+        for (int i = bytes - 2; i >= 0; i--) *coded++ = 0x80 | ((number >> (6 * i)) & 0x3f);
+    }
+    memcpy(coded, frame + 4 + len, extra);
+    coded += extra;
+    *coded = flacCRC8(p, coded - p);
+    coded++;
+
+    // subframes are untouched but CRC-16 covers the whole frame
+    size_t remain = frame + size - 2 - body;
+    memcpy(coded, body, remain);
+    coded += remain;
+    uint16_t crc = flacCRC16(p, coded - p);
+    *coded++ = crc >> 8;
+    *coded++ = crc;
+
+    out.resize(coded - out.data());
+}
+
+void flacCodec::reset(void) {
+    // what is in flight belongs to the previous stream and will be discarded
+    std::scoped_lock lock(parallelMutex);
+    generation++;
+    frames = 0;
+    if (filling) idle.push_back(filling);
+    filling = NULL;
+}
+
+bool flacCodec::parallelWrite(const int16_t* samples, size_t count) {
+    if (encoded->space() < inflight + count * settings.size + minSpace) return false;
+
+    std::unique_lock lock(parallelMutex);
+
+    // take all or nothing
+    size_t room = idle.size() * blockSamples * batchBlocks + (filling ? filling->samples.size() - filling->count : 0);
+    if (room < count) return false;
+
+    while (count) {
+        if (!filling) {
+            filling = idle.front();
+            idle.pop_front();
+            filling->count = 0;
+        }
+
+        size_t chunk = std::min(count, filling->samples.size() - filling->count);
+        sampleKernels::get().widen16(samples, filling->samples.data() + filling->count, chunk);
+        filling->count += chunk;
+        inflight += chunk * settings.size;
+        samples += chunk;
+        count -= chunk;
+
+        if (filling->count == filling->samples.size()) {
+            auto batch = submit();
+            lock.unlock();
+            dispatch(batch);
+            lock.lock();
+        }
+    }
+
+    return true;
+}
+
+flacCodec::batch* flacCodec::submit(void) {
+    // parallelMutex must be locked
+    auto batch = filling;
+    filling = NULL;
+    batch->first = frames;
+    batch->blocksize = blockSamples / settings.channels;
+    batch->generation = generation;
+    batch->done = false;
+    frames += (batch->count + blockSamples - 1) / blockSamples;
+    running.push_back(batch);
+    return batch;
+}
+
+void flacCodec::dispatch(batch* batch) {
+    // codec that is not shared can't be referenced by jobs, so encode inline
+    if (weak_from_this().expired()) {
+        encodeBatch(batch);
+    } else {
+        encoderPool::instance().submit([self = weak_from_this(), batch] {
+            if (auto codec = self.lock()) static_cast<flacCodec*>(codec.get())->encodeBatch(batch);
+        });
+    }
+}
+
+void flacCodec::encodeBatch(batch* batch) {
+    auto batchWrite = [](const FLAC__StreamEncoder* encoder, const FLAC__byte buffer[],
+        size_t bytes, unsigned samples, unsigned current_frame, void* client_data) {
+            // metadata are sent by main encoder only
+            auto batch = (flacCodec::batch*) client_data;
+            if (samples) flacRenumber(buffer, bytes, batch->first + current_frame, batch->frames);
+            return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    };
+
+    // blocksize is forced so that all batches match what main encoder announced
+    batch->frames.clear();
+    if (configure(batch->flac, batch->blocksize) &&
+        !FLAC__stream_encoder_init_stream(batch->flac, batchWrite, NULL, NULL, NULL, batch)) {
+        FLAC__stream_encoder_process_interleaved(batch->flac, batch->samples.data(), batch->count / settings.channels);
+    }
+    FLAC__stream_encoder_finish(batch->flac);
+
+    stitch(batch);
+}
+
+void flacCodec::stitch(batch* done) {
+    {
+        std::scoped_lock lock(parallelMutex);
+        done->done = true;
+        // batches finish in any order, output all that are complete at the front
+        while (!running.empty() && running.front()->done) {
+            auto batch = running.front();
+            running.pop_front();
+            if (batch->generation == generation) encoded->write(batch->frames.data(), batch->frames.size());
+            inflight -= batch->count * settings.size;
+            batch->count = 0;
+            idle.push_back(batch);
+        }
+    }
+    if (onEncoded) onEncoded();
 }
 
 /****************************************************************************************
@@ -355,16 +832,20 @@ private:
     faacEncHandle aac = NULL;
     unsigned long inSamples = 0, outMaxBytes = 0;
     bool drained = false;
+    uint64_t position = 0;
     uint8_t* inBuf = NULL, * outBuf = NULL;
 
-    void process(size_t bytes);
+    bool process(size_t bytes);
     void cleanup(void);
 
 public:
     aacCodec(codecSettings settings, bool store = false);
     virtual ~aacCodec(void) { cleanup(); }
-    virtual int64_t initialize(int64_t duration);
-    virtual void drain(void);
+    virtual bool open(void);
+    virtual int64_t start(int64_t duration);
+    virtual uint32_t bitrate(void) { return settings.aac.bitrate * 1000; }
+    virtual bool drain(void);
+    virtual size_t pending(void) { return encoded->used() + (!async && pcm->used() >= inSamples * settings.size ? pcm->used() : 0); }
 };
 
 aacCodec::aacCodec(codecSettings settings, bool store) : baseCodec(settings, "audio/aac", false) {
@@ -380,14 +861,14 @@ void aacCodec::cleanup(void) {
     }
 }
 
-int64_t aacCodec::initialize(int64_t duration) {
+bool aacCodec::open(void) {
     // clean any current decoder 
     cleanup();
     drained = false;
+    position = 0;
 
-    // in case of failure, return 0
     aac = faacEncOpen(settings.rate, settings.channels, &inSamples, &outMaxBytes);    
-    if (!aac) return 0;
+    if (!aac) return false;
 
     // inSamples is the *total* number of samples, not of frames...
     inBuf = new uint8_t[inSamples * settings.size];
@@ -400,25 +881,33 @@ int64_t aacCodec::initialize(int64_t duration) {
     format->outputFormat = ADTS_STREAM;
     format->inputFormat = FAAC_INPUT_16BIT;
     faacEncSetConfiguration(aac, format);
-    
+    return true;
+}
+
+int64_t aacCodec::start(int64_t duration) {
     return -(duration ? ((int64_t)settings.aac.bitrate * duration) / 8 : INT64_MAX);
 }
 
-void aacCodec::process(size_t bytes) {
+bool aacCodec::process(size_t bytes) {
     size_t blockSize = inSamples * settings.size;
     while (encoded->space() >= outMaxBytes && pcm->used() >= blockSize && (ssize_t)bytes > 0) {
         pcm->read(inBuf, blockSize);
         int len = faacEncEncode(aac, (int32_t*) inBuf, inSamples, outBuf, outMaxBytes);
+        // each output is an ADTS frame (there is none while encoder fills its delay)
+        if (len > 0) mark(position);
         encoded->write(outBuf, len);
+        position += blockSize;
         bytes -= len;
     }
+    return (ssize_t) bytes <= 0;
 }
 
-void aacCodec::drain(void) {
-    if (drained || encoded->space() < outMaxBytes) return;
+bool aacCodec::drain(void) {
+    if (drained || encoded->space() < outMaxBytes) return drained;
     int len = faacEncEncode(aac, NULL, 0, outBuf, outMaxBytes);
     encoded->write(outBuf, len);
     drained = true;
+    return true;
 }
 
 /****************************************************************************************
@@ -430,17 +919,21 @@ private:
     shine_t mp3 = NULL;
     bool drained = false;
     size_t blockSize;
+    uint64_t position = 0;
     int16_t* scratch;
 
-    void process(size_t bytes);
+    bool process(size_t bytes);
     void cleanup();
 
 public:
     mp3Codec(codecSettings settings, bool store = false);
     virtual ~mp3Codec(void) { cleanup(); }
-    virtual int64_t initialize(int64_t duration);
-    virtual void drain(void);
+    virtual bool open(void);
+    virtual int64_t start(int64_t duration);
+    virtual uint32_t bitrate(void) { return settings.mp3.bitrate * 1000; }
+    virtual bool drain(void);
     virtual std::string id() { return std::string("mp3"); }
+    virtual size_t pending(void) { return encoded->used() + (!async && pcm->used() >= blockSize ? pcm->used() : 0); }
 };
 
 mp3Codec::mp3Codec(codecSettings settings, bool store) : baseCodec(settings, "audio/mpeg", store) {
@@ -455,7 +948,7 @@ void mp3Codec::cleanup(void) {
     }
 }
 
-int64_t mp3Codec::initialize(int64_t duration) {
+bool mp3Codec::open(void) {
     struct PACK({
         uint8_t	 id[3];
         uint8_t  version[2];
@@ -481,6 +974,7 @@ int64_t mp3Codec::initialize(int64_t duration) {
     // clean any current decoder 
     cleanup();
     drained = false;
+    position = 0;
 
     // write header with no modification, just so that player thinks it's a file
     if (settings.mp3.id3) encoded->write((uint8_t*)&header, sizeof(header));
@@ -499,27 +993,35 @@ int64_t mp3Codec::initialize(int64_t duration) {
     blockSize = shine_samples_per_pass(mp3) * settings.channels;
     scratch = new int16_t[blockSize];
     blockSize *= settings.size;
+    return true;
+}
 
+int64_t mp3Codec::start(int64_t duration) {
     return -(duration ? ((int64_t)settings.mp3.bitrate * duration) / 8 : INT64_MAX);
 }
 
-void mp3Codec::process(size_t bytes) {
+bool mp3Codec::process(size_t bytes) {
     auto space = std::max(blockSize, minSpace);
     int len;
     while (encoded->space() >= space && pcm->used() >= blockSize && (ssize_t) bytes > 0) {
         pcm->read((uint8_t*)scratch, blockSize);
         uint8_t* coded = shine_encode_buffer_interleaved(mp3, scratch, &len);
+        // each pass outputs whole frames
+        if (len > 0) mark(position);
         encoded->write(coded, len);
+        position += blockSize;
         bytes -= len;
     }
+    return (ssize_t) bytes <= 0;
 }
 
-void mp3Codec::drain(void) {
-    if (drained || encoded->space() < std::max(blockSize, minSpace)) return;
+bool mp3Codec::drain(void) {
+    if (drained || encoded->space() < std::max(blockSize, minSpace)) return drained;
     int len;
     uint8_t* coded = shine_flush(mp3, &len);
     encoded->write(coded, len);
     drained = true;
+    return true;
 }
 
 /****************************************************************************************
@@ -534,9 +1036,12 @@ private:
 public:
     opusCodec(codecSettings settings, bool store = false) : baseCodec(settings, "audio/ogg;codecs=opus", store) { }
     virtual ~opusCodec(void);
-    virtual int64_t initialize(int64_t duration);
+    virtual bool open(void);
+    virtual int64_t start(int64_t duration);
+    virtual uint32_t bitrate(void);
     virtual bool pcmWrite(const uint8_t* data, size_t size);
-    virtual void drain(void);
+    virtual size_t credit(void) { size_t space = encoded->space(); return space >= minSpace ? space / 2 : 0; }
+    virtual bool drain(void);
     virtual std::string id() { return std::string("ops"); }
 };
 
@@ -544,7 +1049,7 @@ opusCodec::~opusCodec(void) {
     if (opus) ope_encoder_destroy(opus);
 }
 
-int64_t opusCodec::initialize(int64_t duration) {  
+bool opusCodec::open(void) {
     // clean any current decoder 
     if (opus) ope_encoder_destroy(opus);
     drained = false;
@@ -562,26 +1067,37 @@ int64_t opusCodec::initialize(int64_t duration) {
     opus = ope_encoder_create_callbacks(&callbacks, this, comments, settings.rate, settings.channels, 1, NULL);
     ope_comments_destroy(comments);
 
-    // in case of failure, return 0
-    if (!opus) return 0;
+    if (!opus) return false;
 
     int bitrate = settings.opus.bitrate * 1000;
     if (bitrate) ope_encoder_ctl(opus, OPUS_SET_BITRATE(bitrate));
-    else ope_encoder_ctl(opus, OPUS_GET_BITRATE(&bitrate));
-   
+    return true;
+}
+
+int64_t opusCodec::start(int64_t duration) {
+    int bitrate;
+    ope_encoder_ctl(opus, OPUS_GET_BITRATE(&bitrate));
     return -(duration ? ((int64_t)bitrate * duration) / 8 : INT64_MAX);
 }
 
+uint32_t opusCodec::bitrate(void) {
+    opus_int32 bitrate = settings.opus.bitrate * 1000;
+    // when not set, encoder decides for itself
+    if (opus) ope_encoder_ctl(opus, OPUS_GET_BITRATE(&bitrate));
+    return bitrate;
+}
+
 bool opusCodec::pcmWrite(const uint8_t * data, size_t len) {
     // we do not block (at least it should not happen)
     if (encoded->space() < std::max(len * 2, minSpace)) return false;
     return ope_encoder_write(opus, (opus_int16*)data, len / (settings.channels * settings.size)) == 0;
 }
 
-void opusCodec::drain(void) {
-    if (drained || encoded->space() < minSpace) return;
+bool opusCodec::drain(void) {
+    if (drained || encoded->space() < minSpace) return drained;
     ope_encoder_drain(opus);
     drained = true;
+    return true;
 }
 
 /****************************************************************************************
@@ -599,15 +1115,18 @@ private:
 
     bool drained = false;
 
-    void process(size_t bytes);
+    bool process(size_t bytes);
     void cleanup(void);
 
 public:
     vorbisCodec(codecSettings settings, bool store = false);
     virtual ~vorbisCodec(void) { cleanup(); }
-    virtual int64_t initialize(int64_t duration);
-    virtual void drain(void);
+    virtual bool open(void);
+    virtual int64_t start(int64_t duration);
+    virtual uint32_t bitrate(void) { return (settings.vorbis.bitrate ? settings.vorbis.bitrate : 160) * 1000; }
+    virtual bool drain(void);
     virtual std::string id() { return std::string("oga"); }
+    virtual size_t pending(void) { return encoded->used() + (!async && pcm->used() > 1024 * settings.channels * settings.size ? pcm->used() : 0); }
 };
 
 vorbisCodec::vorbisCodec(codecSettings settings, bool store) : baseCodec(settings, "audio/ogg;codecs=vorbis", store) {
@@ -624,7 +1143,7 @@ void vorbisCodec::cleanup(void) {
     }
 }
 
-int64_t vorbisCodec::initialize(int64_t duration) {
+bool vorbisCodec::open(void) {
     // clean any current decoder 
     cleanup();
     drained = false;
@@ -636,7 +1155,7 @@ int64_t vorbisCodec::initialize(int64_t duration) {
     //  assume that only this part can go wrong
     if (vorbis_encode_init(&info, settings.channels, settings.rate, bitrate, bitrate * 1.25, bitrate * 0.75)) {
         vorbis_info_clear(&info);
-        return 0;
+        return false;
     }
 
     initialized = true;
@@ -661,11 +1180,14 @@ int64_t vorbisCodec::initialize(int64_t duration) {
 
     // finally initialize a block structure (once is enough)
     vorbis_block_init(&dsp, &block);
+    return true;
+}
 
+int64_t vorbisCodec::start(int64_t duration) {
     return -(duration ? ((int64_t)settings.vorbis.bitrate * duration) / 8 : INT64_MAX);
 }
 
-void vorbisCodec::process(size_t bytes) {
+bool vorbisCodec::process(size_t bytes) {
     while (encoded->space() >= minSpace && pcm->used() > 1024 * settings.channels * settings.size && (ssize_t)bytes > 0) {
         size_t len = 1024 * settings.channels * settings.size;
         // we are always aligned on settings.channels * settings.size;
@@ -673,11 +1195,8 @@ void vorbisCodec::process(size_t bytes) {
         len /= settings.channels * settings.size;
 
         float** buffer = vorbis_analysis_buffer(&dsp, len);
-        for (size_t i = 0; i < len; i++) {
-            buffer[0][i] = *data++ / (float) INT16_MAX;
-            buffer[1][i] = *data++ / (float) INT16_MAX;
-        }
-        pcm->unlock();
+        sampleKernels::get().deinterleave16(data, buffer[0], buffer[1], len, 1.0f / INT16_MAX);
+        pcm->consume(len * settings.channels * settings.size);
         vorbis_analysis_wrote(&dsp, len);
 
         // encode as many blocks as possible
@@ -702,10 +1221,11 @@ void vorbisCodec::process(size_t bytes) {
             }
         }
     }
+    return (ssize_t) bytes <= 0;
 }
 
-void vorbisCodec::drain(void) {
-    if (drained || encoded->space() < minSpace) return;
+bool vorbisCodec::drain(void) {
+    if (drained || encoded->space() < minSpace) return drained;
 
     ogg_page page;
 
@@ -715,6 +1235,7 @@ void vorbisCodec::drain(void) {
     }
 
     drained = true;
+    return true;
 }
 
 /****************************************************************************************
@@ -733,3 +1254,31 @@ std::unique_ptr<baseCodec> createCodec(codecSettings::type codec, codecSettings
     default: return nullptr;
     }
 }
+
+std::unique_ptr<baseCodec> createCodec(const std::string& codec) {
+    codecSettings settings;
+
+    if (codec.find("pcm") != std::string::npos) {
+        return createCodec(codecSettings::PCM, settings);
+    } else if (codec.find("wav") != std::string::npos) {
+        return createCodec(codecSettings::WAV, settings);
+    } else if (codec.find("flac") != std::string::npos || codec.find("flc") != std::string::npos) {
+        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.flac.level);
+        settings.flac.parallel = codec.find(":mt") != std::string::npos;
+        return createCodec(codecSettings::FLAC, settings);
+    } else if (codec.find("opus") != std::string::npos) {
+        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.opus.bitrate);
+        return createCodec(codecSettings::OPUS, settings);
+    } else if (codec.find("vorbis") != std::string::npos) {
+        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.vorbis.bitrate);
+        return createCodec(codecSettings::VORBIS, settings);
+    } else if (codec.find("aac") != std::string::npos) {
+        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.aac.bitrate);
+        return createCodec(codecSettings::AAC, settings);
+    } else if (codec.find("mp3") != std::string::npos) {
+        (void)!sscanf(codec.c_str(), "%*[^:]:%d", &settings.mp3.bitrate);
+        return createCodec(codecSettings::MP3, settings);
+    } else {
+        throw std::runtime_error("unknown codec " + codec);
+    }
+}
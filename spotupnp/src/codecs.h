@@ -3,32 +3,53 @@
 #include <vector>
 #include <inttypes.h>
 #include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <deque>
+
+#include "memoryPool.h"
 
 /****************************************************************************************
- * Ring buffer
+ * Ring buffer, wait-free for a single producer and a single consumer. Indexes only grow
+ * and are published with release/acquire so that each side only writes its own index.
+ * Reader can access data in place with readInner() and then must consume() it. Data is
+ * in pool segments that producer takes when it needs them and consumer gives back once
+ * it has read them. Consumer hands one segment over to producer instead, so that pool (and
+ * its lock) is only used when the buffer grows or shrinks. Capacity is the lowest of size
+ * and fair share of memory budget
  */
 class byteBuffer {
 private:
-    uint8_t* buffer;
-    uint8_t* read_p, * write_p, * wrap_p;
-    size_t size;
-    std::mutex mutex;
+    std::unique_ptr<std::atomic<uint8_t*>[]> segments;
+    size_t size, count;
+    std::atomic<size_t> head = 0, tail = 0;
+    // segment released by consumer and not yet reused by producer
+    std::atomic<uint8_t*> spare = NULL;
     FILE* storage;
+    bool parked = false;
 
-    size_t _space(void) { return size - _used() - 1; }
-    size_t _used(void) { return write_p >= read_p ? write_p - read_p : size - (read_p - write_p); }
+    std::atomic<uint8_t*>& segment(size_t pos) { return segments[(pos / memoryPool::segmentSize) % count]; }
+    void advance(size_t tail);
 
 public:
     byteBuffer(FILE* storage = NULL, size_t size = 4 * 1024 * 1024);
     ~byteBuffer(void);
     size_t read(uint8_t* dst, size_t max, size_t min = 0);
     uint8_t* readInner(size_t& size);
+    void consume(size_t size) { advance(tail.load(std::memory_order_relaxed) + size); }
     bool write(const uint8_t* src, size_t size);
-    size_t space(void) { std::scoped_lock lock(mutex); return _space(); }
-    size_t used(void) { std::scoped_lock lock(mutex); return _used(); }
-    void flush(void) { std::scoped_lock lock(mutex); read_p = write_p = buffer; }
-    void lock(void) { mutex.lock(); }
-    void unlock(void) { mutex.unlock(); }
+    size_t capacity(void) { return std::min(size, memoryPool::instance().share()); }
+    size_t space(void) { size_t cap = capacity(), used = this->used(); return cap > used ? cap - used : 0; }
+    size_t used(void) { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+    // all that has ever been written
+    size_t written(void) { return head.load(std::memory_order_acquire); }
+    // consumer side only
+    void flush(void) { advance(head.load(std::memory_order_acquire)); }
+    // a parked buffer (not in use yet) does not take a share of memory budget
+    void park(bool parked);
 };
 
 class codecSettings {
@@ -38,6 +59,7 @@ public:
     uint8_t channels = 2, size = 2;
     struct {
       int level = 5;
+      bool parallel = false;
     } flac;
     struct {
        int bitrate = 0;
@@ -55,19 +77,50 @@ public:
  Note that the whole implementation assumes that every buffer of samples contains 
  a set of full frames (i.e. a multiply of 16 bits L+R = 4 bytes
  */
-class baseCodec {
+class baseCodec : public std::enable_shared_from_this<baseCodec> {
 private:
     static uint32_t index;
+    // encoding requests not yet served by the pool
+    std::atomic<uint32_t> requests = 0;
+    // reader has asked for the end of stream, and encoder has output all it had
+    std::atomic<bool> finishing = false, finished = false;
+    // where frames start in output (PCM position, offset from start of track), one per second
+    std::mutex syncMutex;
+    std::deque<std::pair<uint64_t, uint64_t>> syncPoints;
+    uint64_t nextMark = 0;
+    size_t origin = 0;
+    void schedule(void);
+    void encode(void);
 
 protected:
     codecSettings settings;
+    // tells owner that encoded data is available (when encoding is done in the pool)
+    std::function<void()> onEncoded;
     static size_t minSpace;
     uint32_t pcmBitrate;
     std::shared_ptr<byteBuffer> pcm, encoded;
     int total = 0;
 
-    virtual void process(size_t bytes) { }
+    bool ready = false;
+    // encoding is done in the pool, never by the reader, and this lock serializes it
+    bool async = false;
+    // codec encodes in the pool by itself (even if pcm == encoded)
+    bool parallel = false;
+    std::mutex encoding;
+    static const size_t jobBudget = 32 * 1024;
+
+    // returns true when it stopped because of budget, so there might be more to encode
+    virtual bool process(size_t bytes) { return false; }
     virtual void cleanup() { }
+    // what does not depend on the track (can be done ahead of time), must reset encoder
+    virtual bool open(void) { return true; }
+    // what depends on the track, returns length (negative when it is an estimation)
+    virtual int64_t start(int64_t duration) = 0;
+    // output encoder's tail, returns false when it has to be called again
+    virtual bool drain(void) { return true; }
+    void finish(void) { finished = drain(); }
+    // next write to output is the start of a frame that decodes on its own, with that much PCM before it
+    void mark(uint64_t position);
 
 public:
     std::string mimeType;
@@ -75,15 +128,34 @@ public:
 
     baseCodec(codecSettings settings, std::string mimeType, bool store = false);
     virtual ~baseCodec(void) { }
-    virtual bool pcmWrite(const uint8_t* data, size_t size) { return pcm->write(data, size); }
-    void unlock(void) { encoded->unlock(); }
+    virtual bool pcmWrite(const uint8_t* data, size_t size);
+    // what pcmWrite() can accept right now
+    virtual size_t credit(void) { return pcm->space(); }
+    void consume(size_t size) { encoded->consume(size); }
     bool isEmpty(void) { return encoded->used(); }
-    virtual void flush(void) { total = 0;  pcm->flush(); encoded->flush(); }
-    virtual int64_t initialize(int64_t duration) = 0;
+    // what read() can return without waiting for more PCM
+    virtual size_t pending(void) { return encoded->used(); }
+    // PCM received but not yet encoded
+    virtual size_t buffered(void) { return pcm == encoded ? encoded->used() : pcm->used(); }
+    uint64_t pcmToMs(uint64_t bytes) { return bytes * 8 * 1000 / pcmBitrate; }
+    // encoded bitrate (bits per second), an estimation for VBR or lossless
+    virtual uint32_t bitrate(void) { return pcmBitrate; }
+    virtual void flush(void);
+    void offload(std::function<void()> onEncoded);
+    void park(bool parked) { pcm->park(parked); if (encoded != pcm) encoded->park(parked); }
+    bool prepare(void);
+    int64_t initialize(int64_t duration);
     virtual size_t read(uint8_t* dst, size_t size, size_t min = 0, bool drain = false);
     virtual uint8_t* readInner(size_t& size, bool drain = false);
-    virtual void drain(void) { }
+    // end of stream has been fully read, once read() has been asked to drain
+    bool isDrained(void) { return finished && !encoded->used(); }
     virtual std::string id();
+    // once stream is complete, fix start of its copy (data) that was written with estimated length
+    virtual void patchHeader(uint8_t* data, size_t size, uint64_t length, uint64_t pcm) { }
+    // oldest frame start before limit in output, as PCM position and offset from start of track
+    bool syncPoint(uint64_t limit, uint64_t& position, uint64_t& offset);
 };
 
-std::unique_ptr<baseCodec> createCodec(codecSettings::type codec, codecSettings settings, bool store = false);
\ No newline at end of file
+std::unique_ptr<baseCodec> createCodec(codecSettings::type codec, codecSettings settings, bool store = false);
+// from the codec config key (pcm, wav, flac:5, flac:5:mt, mp3:320, opus:128 ...)
+std::unique_ptr<baseCodec> createCodec(const std::string& codec);
\ No newline at end of file
@@ -60,6 +60,9 @@ void SaveConfig(char *name, void *ref, bool full) {
 	XMLUpdateNode(doc, root, false, "credentials_path", glCredentialsPath);
 	XMLUpdateNode(doc, root, false, "credentials", "%d", glCredentials);
 	XMLUpdateNode(doc, root, false, "ports", "%hu:%hu", glPortBase, glPortRange);
+	XMLUpdateNode(doc, root, false, "track_cache", glTrackCachePath);
+	XMLUpdateNode(doc, root, false, "track_cache_size", "%u", glTrackCacheSize);
+	XMLUpdateNode(doc, root, false, "memory_budget", "%u", glMemoryBudget);
 	
 	// Save client_id directly at root level (not nested)
 	if (full || !old_doc || *glClientId) {
@@ -76,6 +79,8 @@ void SaveConfig(char *name, void *ref, bool full) {
 	XMLUpdateNode(doc, common, false, "flow", "%d", glMRConfig.Flow);
 	XMLUpdateNode(doc, common, false, "use_filecache", "%d", glMRConfig.CacheMode);
 	XMLUpdateNode(doc, common, false, "gapless", "%d", glMRConfig.Gapless);
+	XMLUpdateNode(doc, common, false, "pacing_burst", "%d", glMRConfig.PacingBurst);
+	XMLUpdateNode(doc, common, false, "pacing_rate", "%d", glMRConfig.PacingRate);
 	XMLUpdateNode(doc, common, false, "artwork", "%s", glMRConfig.ArtWork);
 	XMLUpdateNode(doc, common, true, "deviceid_prefix", "%s", glDeviceIdPrefix);
 
@@ -143,7 +148,10 @@ static void LoadConfigItem(tMRConfig *Conf, char *name, char *val) {
 	if (!strcmp(name, "flow")) Conf->Flow = atoi(val);
 	if (!strcmp(name, "use_filecache")) Conf->CacheMode = atoi(val);
 	if (!strcmp(name, "gapless")) Conf->Gapless = atoi(val);
+	if (!strcmp(name, "pacing_burst")) Conf->PacingBurst = atoi(val);
+	if (!strcmp(name, "pacing_rate")) Conf->PacingRate = atoi(val);
 	if (!strcmp(name, "artwork")) strcpy(Conf->ArtWork, val);
+	if (!strcmp(name, "follow")) strncpy(Conf->Follow, val, sizeof(Conf->Follow) - 1);
 	if (!strcmp(name, "credentials")) strcpy(Conf->Credentials, val);
 	if (!strcmp(name, "deviceid_prefix")) strncpy(glDeviceIdPrefix, val, sizeof(glDeviceIdPrefix) - 1);
 	if (!strcmp(name, "name")) strcpy(Conf->Name, val);
@@ -168,6 +176,9 @@ static void LoadGlobalItem(char *name, char *val) {
 	if (!strcmp(name, "ports")) sscanf(val, "%hu:%hu", &glPortBase, &glPortRange);
 	if (!strcmp(name, "credentials")) glCredentials = atol(val);
 	if (!strcmp(name, "credentials_path")) strncpy(glCredentialsPath, val, sizeof(glCredentialsPath) - 1);
+	if (!strcmp(name, "track_cache")) strncpy(glTrackCachePath, val, sizeof(glTrackCachePath) - 1);
+	if (!strcmp(name, "track_cache_size")) glTrackCacheSize = atol(val);
+	if (!strcmp(name, "memory_budget")) glMemoryBudget = atol(val);
 	if (!strcmp(name, "client_id")) strncpy(glClientId, val, sizeof(glClientId) - 1);
 	if (!strcmp(name, "client_secret")) strncpy(glClientSecret, val, sizeof(glClientSecret) - 1);
  }
@@ -0,0 +1,82 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <algorithm>
+
+#include "encoderPool.h"
+
+/****************************************************************************************
+ * Work-stealing pool
+ */
+
+encoderPool& encoderPool::instance(void) {
+    // leave a core for the HTTP loop and decoders
+    static encoderPool pool(std::max(std::thread::hardware_concurrency(), 2U) - 1);
+    return pool;
+}
+
+encoderPool::encoderPool(unsigned count) {
+    for (unsigned i = 0; i < count; i++) workers.push_back(std::make_unique<worker>());
+    for (size_t i = 0; i < workers.size(); i++) workers[i]->thread = std::thread(&encoderPool::run, this, i);
+}
+
+encoderPool::~encoderPool(void) {
+    {
+        std::scoped_lock lock(mutex);
+        running = false;
+    }
+    idle.notify_all();
+    for (auto& worker : workers) worker->thread.join();
+}
+
+void encoderPool::submit(std::function<void()> job) {
+    // counter must be updated under pool's lock or a worker might miss it and sleep, and
+    // before the job is visible so that it never goes below zero
+    {
+        std::scoped_lock lock(mutex);
+        queued++;
+    }
+    auto& worker = *workers[next++ % workers.size()];
+    {
+        std::scoped_lock lock(worker.mutex);
+        worker.jobs.push_back(std::move(job));
+    }
+    idle.notify_one();
+}
+
+bool encoderPool::take(size_t index, std::function<void()>& job) {
+    // own queue first (oldest job), then steal from the others (newest job)
+    for (size_t i = 0; i < workers.size(); i++) {
+        auto& worker = *workers[(index + i) % workers.size()];
+        std::scoped_lock lock(worker.mutex);
+        if (worker.jobs.empty()) continue;
+        if (!i) {
+            job = std::move(worker.jobs.front());
+            worker.jobs.pop_front();
+        } else {
+            job = std::move(worker.jobs.back());
+            worker.jobs.pop_back();
+        }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void encoderPool::run(size_t index) {
+    while (true) {
+        std::function<void()> job;
+
+        if (!take(index, job)) {
+            std::unique_lock lock(mutex);
+            idle.wait(lock, [this] { return queued || !running; });
+            if (!running) return;
+            continue;
+        }
+
+        job();
+    }
+}
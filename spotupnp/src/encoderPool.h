@@ -0,0 +1,48 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+
+/****************************************************************************************
+ * Process-wide pool of threads that run encoding jobs, so that encoders don't run in the
+ * HTTP loop and use all cores. Each worker has its own queue, jobs are spread round-robin
+ * and idle workers steal from others. A job is meant to be short (a bounded amount of
+ * encoding) and to re-submit itself when there is more to do, so that it goes back at the
+ * end of the queue and all streams get their turn
+ */
+class encoderPool {
+private:
+    struct worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::atomic<size_t> queued = 0, next = 0;
+    bool running = true;
+
+    encoderPool(unsigned count);
+    ~encoderPool(void);
+    void run(size_t index);
+    bool take(size_t index, std::function<void()>& job);
+
+public:
+    static encoderPool& instance(void);
+    void submit(std::function<void()> job);
+    size_t size(void) { return workers.size(); }
+};
@@ -0,0 +1,50 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <algorithm>
+
+#include "memoryPool.h"
+
+/****************************************************************************************
+ * Segment pool
+ */
+
+memoryPool& memoryPool::instance(void) {
+    static memoryPool pool;
+    return pool;
+}
+
+size_t memoryPool::share(void) {
+    size_t share = budget.load(std::memory_order_relaxed) / std::max(users.load(std::memory_order_relaxed), 1U);
+    // round down to segments so that buffers don't take one they are not entitled to
+    return std::max(share - share % segmentSize, minShare);
+}
+
+uint8_t* memoryPool::acquire(void) {
+    used.fetch_add(segmentSize, std::memory_order_relaxed);
+    {
+        std::scoped_lock lock(mutex);
+        if (!spare.empty()) {
+            auto segment = spare.back();
+            spare.pop_back();
+            return segment;
+        }
+    }
+    return new uint8_t[segmentSize];
+}
+
+void memoryPool::release(uint8_t* segment) {
+    used.fetch_sub(segmentSize, std::memory_order_relaxed);
+    {
+        // keep a few segments at hand as buffers come and go all the time
+        std::scoped_lock lock(mutex);
+        if (spare.size() < maxSpare) {
+            spare.push_back(segment);
+            return;
+        }
+    }
+    delete[] segment;
+}
@@ -0,0 +1,47 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <inttypes.h>
+
+/****************************************************************************************
+ * Process-wide pool of fixed-size segments used by all audio buffers. Buffers take
+ * segments as they fill and give them back as they are consumed or flushed, so memory
+ * follows what is actually buffered. Each buffer is entitled to a fair share of the
+ * budget (budget divided by the number of buffers) and is expected to not go beyond it.
+ * Acquiring never fails because buffers need to honour what they claim as free space,
+ * so the budget is enforced by buffers' sizing, not by refusing segments
+ */
+class memoryPool {
+public:
+    static constexpr size_t segmentSize = 128 * 1024;
+    // every buffer gets at least that, even when budget is exhausted
+    static constexpr size_t minShare = 2 * segmentSize;
+
+private:
+    std::mutex mutex;
+    std::vector<uint8_t*> spare;
+    std::atomic<size_t> budget = 256 * 1024 * 1024, used = 0;
+    std::atomic<uint32_t> users = 0;
+    static const size_t maxSpare = 16;
+
+    memoryPool(void) { }
+
+public:
+    static memoryPool& instance(void);
+    void setBudget(size_t budget) { this->budget = budget; }
+    size_t getBudget(void) { return budget; }
+    size_t inUse(void) { return used.load(std::memory_order_relaxed); }
+    void join(void) { users++; }
+    void leave(void) { users--; }
+    size_t share(void);
+    uint8_t* acquire(void);
+    void release(uint8_t* segment);
+};
@@ -0,0 +1,138 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <algorithm>
+#include <functional>
+#include <cstdarg>
+
+#include "metrics.h"
+#include "trackCache.h"
+#include "memoryPool.h"
+
+/****************************************************************************************
+ * Registry and Prometheus text exposition
+ */
+
+template <typename T> static void enlist(std::vector<std::weak_ptr<T>>& registry, std::shared_ptr<T> object) {
+    // dead objects are forgotten here too, or without scraping registry would grow forever
+    // and each expired reference would pin its object's storage (they are make_shared)
+    std::erase_if(registry, [](auto& item) { return item.expired(); });
+    registry.push_back(object);
+}
+
+void metrics::add(std::shared_ptr<deviceMetrics> device) {
+    std::scoped_lock lock(mutex);
+    enlist(devices, device);
+}
+
+void metrics::add(std::shared_ptr<streamMetrics> stream) {
+    std::scoped_lock lock(mutex);
+    enlist(streams, stream);
+}
+
+static std::string escape(const std::string& value) {
+    std::string escaped;
+    for (auto c : value) {
+        if (c == '"' || c == '\\') escaped += '\\';
+        if (c == '\n') escaped += "\\n";
+        else escaped += c;
+    }
+    return escaped;
+}
+
+static void append(std::string& out, const char* format, ...) {
+    char buffer[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (len > 0) out.append(buffer, std::min(len, (int) sizeof(buffer) - 1));
+}
+
+std::string metrics::render(void) {
+    std::vector<std::shared_ptr<deviceMetrics>> devices;
+    std::vector<std::shared_ptr<streamMetrics>> streams;
+
+    // take a snapshot of live objects and forget about the dead ones
+    {
+        std::scoped_lock lock(mutex);
+        auto collect = [](auto& registry, auto& live) {
+            registry.erase(std::remove_if(registry.begin(), registry.end(), [&live](auto& item) {
+                auto object = item.lock();
+                if (object) live.push_back(object);
+                return !object;
+            }), registry.end());
+        };
+        collect(metrics::devices, devices);
+        collect(metrics::streams, streams);
+    }
+
+    std::string out;
+    auto family = [&out](const char* name, const char* type, const char* help) {
+        append(out, "# HELP spotconnect_%s %s\n# TYPE spotconnect_%s %s\n", name, help, name, type);
+    };
+    auto device = [&out, &devices](const char* name, std::function<uint64_t(deviceMetrics&)> get) {
+        for (auto& device : devices) {
+            append(out, "spotconnect_%s{device=\"%s\",name=\"%s\"} %" PRIu64 "\n", name, escape(device->id).c_str(),
+                   escape(device->name).c_str(), get(*device));
+        }
+    };
+    auto stream = [&out, &streams](const char* name, std::function<uint64_t(streamMetrics&)> get) {
+        for (auto& stream : streams) {
+            append(out, "spotconnect_%s{device=\"%s\",stream=\"%s\"} %" PRIu64 "\n", name, escape(stream->device).c_str(),
+                   escape(stream->stream).c_str(), get(*stream));
+        }
+    };
+    auto relaxed = std::memory_order_relaxed;
+
+    family("pcm_rejected_writes_total", "counter", "PCM writes refused because encoder was full");
+    device("pcm_rejected_writes_total", [=](auto& d) { return d.pcmRejected.load(relaxed); });
+    family("upnp_actions_total", "counter", "UPnP actions completed");
+    device("upnp_actions_total", [=](auto& d) { return d.actions.load(relaxed); });
+    family("upnp_action_errors_total", "counter", "UPnP actions completed with an error");
+    device("upnp_action_errors_total", [=](auto& d) { return d.actionErrors.load(relaxed); });
+    family("upnp_error_count", "gauge", "Consecutive UPnP action errors (-1 when unreachable)");
+    device("upnp_error_count", [=](auto& d) { return (uint64_t) std::max(d.errorCount.load(relaxed), 0); });
+    family("upnp_action_rtt_ms", "gauge", "Round-trip time of last transport action");
+    device("upnp_action_rtt_ms", [=](auto& d) { return d.actionRtt.load(relaxed); });
+    family("upnp_action_rtt_ms_sum", "counter", "Sum of transport actions round-trip times");
+    device("upnp_action_rtt_ms_sum", [=](auto& d) { return d.actionRttSum.load(relaxed); });
+    family("upnp_action_rtt_ms_count", "counter", "Number of timed transport actions");
+    device("upnp_action_rtt_ms_count", [=](auto& d) { return d.actionRttCount.load(relaxed); });
+
+    family("pcm_in_bytes_total", "counter", "PCM bytes accepted by stream");
+    stream("pcm_in_bytes_total", [=](auto& s) { return s.pcmIn.load(relaxed); });
+    family("encoded_out_bytes_total", "counter", "Encoded bytes produced by stream");
+    stream("encoded_out_bytes_total", [=](auto& s) { return s.encodedOut.load(relaxed); });
+    family("sent_bytes_total", "counter", "Bytes sent to clients of stream, including HTTP framing");
+    stream("sent_bytes_total", [=](auto& s) { return s.sent.load(relaxed); });
+    family("cache_level_bytes", "gauge", "Encoded bytes available in stream's cache");
+    stream("cache_level_bytes", [=](auto& s) { return s.cacheLevel.load(relaxed); });
+    family("encoder_backlog_bytes", "gauge", "Bytes waiting in stream's encoder");
+    stream("encoder_backlog_bytes", [=](auto& s) { return s.backlog.load(relaxed); });
+    family("socket_queue_bytes", "gauge", "Bytes sent but not yet acknowledged by stream's client");
+    stream("socket_queue_bytes", [=](auto& s) { return s.socketQueue.load(relaxed); });
+    family("connections", "gauge", "HTTP connections of stream");
+    stream("connections", [=](auto& s) { return (uint64_t) s.connections.load(relaxed); });
+    family("first_byte_ms", "gauge", "Time from track load to first byte served");
+    stream("first_byte_ms", [=](auto& s) { return (uint64_t) s.firstByte.load(relaxed); });
+
+    family("memory_used_bytes", "gauge", "Memory taken by audio buffers from the pool");
+    append(out, "spotconnect_memory_used_bytes %zu\n", memoryPool::instance().inUse());
+    family("memory_budget_bytes", "gauge", "Memory budget shared by audio buffers");
+    append(out, "spotconnect_memory_budget_bytes %zu\n", memoryPool::instance().getBudget());
+
+    if (auto cache = trackCache::instance()) {
+        family("track_cache_lookups_total", "counter", "Track cache lookups");
+        append(out, "spotconnect_track_cache_lookups_total %" PRIu64 "\n", cache->lookups.load(relaxed));
+        family("track_cache_hits_total", "counter", "Track cache hits");
+        append(out, "spotconnect_track_cache_hits_total %" PRIu64 "\n", cache->hits.load(relaxed));
+        family("track_cache_saved_bytes_total", "counter", "Encoded bytes served from track cache");
+        append(out, "spotconnect_track_cache_saved_bytes_total %" PRIu64 "\n", cache->saved.load(relaxed));
+    }
+
+    return out;
+}
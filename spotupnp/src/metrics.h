@@ -0,0 +1,54 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <inttypes.h>
+
+/****************************************************************************************
+ * Counters and gauges of the streaming pipeline. Owners update them with relaxed atomics
+ * (no lock, no ordering) and the registry only holds weak references, so the lock is
+ * taken when objects are created and when metrics are scraped, never while streaming
+ */
+struct deviceMetrics {
+    std::string id, name;
+    std::atomic<uint64_t> pcmRejected = 0, actions = 0, actionErrors = 0, actionRttSum = 0, actionRttCount = 0;
+    std::atomic<uint32_t> actionRtt = 0;
+    std::atomic<int32_t> errorCount = 0;
+    deviceMetrics(std::string id, std::string name) : id(id), name(name) { }
+};
+
+struct streamMetrics {
+    std::string device, stream;
+    std::atomic<uint64_t> pcmIn = 0, encodedOut = 0, sent = 0;
+    std::atomic<uint64_t> cacheLevel = 0, backlog = 0, socketQueue = 0;
+    std::atomic<uint32_t> connections = 0, firstByte = 0;
+    streamMetrics(std::string device, std::string stream) : device(device), stream(stream) { }
+};
+
+class metrics {
+private:
+    inline static std::mutex mutex;
+    inline static std::vector<std::weak_ptr<deviceMetrics>> devices;
+    inline static std::vector<std::weak_ptr<streamMetrics>> streams;
+
+public:
+    static void add(std::shared_ptr<deviceMetrics> device);
+    static void add(std::shared_ptr<streamMetrics> stream);
+    static std::string render(void);
+
+    template <typename T> static void inc(std::atomic<T>& counter, T value = 1) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+    template <typename T> static void set(std::atomic<T>& gauge, T value) {
+        gauge.store(value, std::memory_order_relaxed);
+    }
+};
@@ -44,6 +44,22 @@ int CalcGroupVolume(struct sMR *Device) {
 	return GroupVolume / n;
 }
 
+/*----------------------------------------------------------------------------*/
+struct sMR *GetLeader(struct sMR *Device)
+{
+	if (!*Device->Config.Follow) return NULL;
+
+	// leader can be designated by its name or its UDN, and must be a master itself
+	for (int i = 0; i < glMaxDevices; i++) {
+		struct sMR *p = glMRDevices + i;
+		if (!p->Running || p == Device || p->Master) continue;
+		if (!strcasecmp(p->Config.Name, Device->Config.Follow) || !strcasecmp(p->friendlyName, Device->Config.Follow) ||
+			strcasestr(p->UDN, Device->Config.Follow)) return p;
+	}
+
+	return NULL;
+}
+
 /*----------------------------------------------------------------------------*/
 struct sMR *GetMaster(struct sMR *Device, char **Name)
 {
@@ -0,0 +1,153 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <cstring>
+#include <cstdlib>
+
+#include "sampleKernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#elif defined(__ARM_NEON)
+#define KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+/****************************************************************************************
+ * Scalar (reference and tail)
+ */
+
+static void byteswap16Scalar(uint16_t* data, size_t count) {
+    for (; count; count--, data++) {
+#ifdef _WIN32
+        *data = _byteswap_ushort(*data);
+#else
+        *data = __builtin_bswap16(*data);
+#endif
+    }
+}
+
+static void widen16Scalar(const int16_t* src, int32_t* dst, size_t count) {
+    for (; count; count--) *dst++ = *src++;
+}
+
+static void deinterleave16Scalar(const int16_t* src, float* left, float* right, size_t frames, float scale) {
+    for (; frames; frames--) {
+        *left++ = *src++ * scale;
+        *right++ = *src++ * scale;
+    }
+}
+
+static const sampleKernels scalar = { "scalar", byteswap16Scalar, widen16Scalar, deinterleave16Scalar };
+
+/****************************************************************************************
+ * x86 (functions are compiled for their own ISA, so no build flag is needed)
+ */
+
+#ifdef KERNELS_X86
+TARGET("sse2") static void byteswap16SSE2(uint16_t* data, size_t count) {
+    for (; count >= 8; count -= 8, data += 8) {
+        __m128i v = _mm_loadu_si128((__m128i*) data);
+        _mm_storeu_si128((__m128i*) data, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+    byteswap16Scalar(data, count);
+}
+
+TARGET("sse2") static void widen16SSE2(const int16_t* src, int32_t* dst, size_t count) {
+    for (; count >= 8; count -= 8, src += 8, dst += 8) {
+        __m128i v = _mm_loadu_si128((__m128i*) src);
+        // put sample in upper half and shift it back with sign
+        _mm_storeu_si128((__m128i*) dst, _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        _mm_storeu_si128((__m128i*) (dst + 4), _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    }
+    widen16Scalar(src, dst, count);
+}
+
+TARGET("sse2") static void deinterleave16SSE2(const int16_t* src, float* left, float* right, size_t frames, float scale) {
+    __m128 factor = _mm_set1_ps(scale);
+    for (; frames >= 4; frames -= 4, src += 8, left += 4, right += 4) {
+        __m128i v = _mm_loadu_si128((__m128i*) src);
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+        _mm_storeu_ps(left, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)), factor));
+        _mm_storeu_ps(right, _mm_mul_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)), factor));
+    }
+    deinterleave16Scalar(src, left, right, frames, scale);
+}
+
+TARGET("avx2") static void byteswap16AVX2(uint16_t* data, size_t count) {
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; count >= 16; count -= 16, data += 16) {
+        __m256i v = _mm256_loadu_si256((__m256i*) data);
+        _mm256_storeu_si256((__m256i*) data, _mm256_shuffle_epi8(v, mask));
+    }
+    byteswap16SSE2(data, count);
+}
+
+static const sampleKernels sse2 = { "sse2", byteswap16SSE2, widen16SSE2, deinterleave16SSE2 };
+// widening and deinterleaving are bound by memory and AVX2 does not beat SSE2 on them
+static const sampleKernels avx2 = { "avx2", byteswap16AVX2, widen16SSE2, deinterleave16SSE2 };
+#endif
+
+/****************************************************************************************
+ * NEON (always there on aarch64, on 32 bits ARM only when compiler is told to use it)
+ */
+
+#ifdef KERNELS_NEON
+static void byteswap16NEON(uint16_t* data, size_t count) {
+    for (; count >= 8; count -= 8, data += 8) {
+        vst1q_u8((uint8_t*) data, vrev16q_u8(vld1q_u8((uint8_t*) data)));
+    }
+    byteswap16Scalar(data, count);
+}
+
+static void widen16NEON(const int16_t* src, int32_t* dst, size_t count) {
+    for (; count >= 8; count -= 8, src += 8, dst += 8) {
+        int16x8_t v = vld1q_s16(src);
+        vst1q_s32(dst, vmovl_s16(vget_low_s16(v)));
+        vst1q_s32(dst + 4, vmovl_s16(vget_high_s16(v)));
+    }
+    widen16Scalar(src, dst, count);
+}
+
+static void deinterleave16NEON(const int16_t* src, float* left, float* right, size_t frames, float scale) {
+    for (; frames >= 8; frames -= 8, src += 16, left += 8, right += 8) {
+        // structured load does the deinterleaving
+        int16x8x2_t v = vld2q_s16(src);
+        vst1q_f32(left, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0]))), scale));
+        vst1q_f32(left + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0]))), scale));
+        vst1q_f32(right, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1]))), scale));
+        vst1q_f32(right + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1]))), scale));
+    }
+    deinterleave16Scalar(src, left, right, frames, scale);
+}
+
+static const sampleKernels neon = { "neon", byteswap16NEON, widen16NEON, deinterleave16NEON };
+#endif
+
+/****************************************************************************************
+ * Dispatch
+ */
+
+std::vector<const sampleKernels*> sampleKernels::available(void) {
+    std::vector<const sampleKernels*> list = { &scalar };
+#if defined(KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) list.push_back(&sse2);
+    if (__builtin_cpu_supports("avx2")) list.push_back(&avx2);
+#elif defined(KERNELS_NEON)
+    list.push_back(&neon);
+#endif
+    return list;
+}
+
+const sampleKernels& sampleKernels::get(void) {
+    static const sampleKernels& best = *available().back();
+    return best;
+}
@@ -0,0 +1,33 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <inttypes.h>
+
+/****************************************************************************************
+ * Sample format conversions used by codecs' input paths. There is a scalar version and,
+ * depending on the CPU, SSE2/AVX2 (x86, chosen at runtime) or NEON (ARM, when compiler
+ * targets it) versions. Pointers don't need to be aligned and counts don't need to be a
+ * multiple of the vector width, the tail is done by scalar code
+ */
+class sampleKernels {
+public:
+    const char* name;
+    // swap bytes of 16 bits samples in place
+    void (*byteswap16)(uint16_t* data, size_t count);
+    // sign-extend 16 bits samples to 32 bits
+    void (*widen16)(const int16_t* src, int32_t* dst, size_t count);
+    // split interleaved 16 bits stereo frames in two float channels multiplied by scale
+    void (*deinterleave16)(const int16_t* src, float* left, float* right, size_t frames, float scale);
+
+    // best version for this CPU (chosen once)
+    static const sampleKernels& get(void);
+    // all versions this CPU can run, scalar first
+    static std::vector<const sampleKernels*> available(void);
+};
@@ -117,9 +117,13 @@ private:
 
     std::deque<std::shared_ptr<HTTPstreamer>> streamers;
     std::shared_ptr<HTTPstreamer> player;
+    std::shared_ptr<deviceMetrics> stats;
+    std::shared_ptr<streamerPool> pool;
 
     bool flow;
     int cacheMode;
+    // seconds sent at once, then % of encoded bitrate
+    int pacingBurst, pacingRate;
     std::deque<uint32_t> flowMarkers;
     std::unordered_set<std::string> flowPlayedTracks;
     cspot::TrackInfo flowTrackInfo;
@@ -142,10 +146,11 @@ public:
     inline static std::string oauthTokens = "";  // OAuth2 tokens JSON
 
     CSpotPlayer(char* name, char* id, char *credentials, struct in_addr addr, AudioFormat audio, char* codec, bool flow,
-        int64_t contentLength, int cacheMode, struct shadowPlayer* shadow, pthread_mutex_t* mutex);
+        int64_t contentLength, int cacheMode, int pacingBurst, int pacingRate, struct shadowPlayer* shadow, pthread_mutex_t* mutex);
     ~CSpotPlayer();
     void disconnect(bool abort = false);
     std::string getDeviceId() const { return blob ? blob->getDeviceId() : ""; }
+    void reportAction(int32_t rtt, bool success, int errorCount);
 
     void friend notify(CSpotPlayer *self, enum shadowEvent event, va_list args);
     bool friend getMetaForUrl(CSpotPlayer* self, const std::string url, metadata_t* metadata);
@@ -157,12 +162,14 @@ static std::mutex validPlayersMutex;
 static std::unordered_set<CSpotPlayer*> validPlayers;
 
 CSpotPlayer::CSpotPlayer(char* name, char* id, char *credentials, struct in_addr addr, AudioFormat format, char* codec, bool flow,
-    int64_t contentLength, int cacheMode, struct shadowPlayer* shadow, pthread_mutex_t* mutex) : bell::Task("playerInstance",
+    int64_t contentLength, int cacheMode, int pacingBurst, int pacingRate, struct shadowPlayer* shadow, pthread_mutex_t* mutex) : bell::Task("playerInstance",
         48 * 1024, 0, 0),
     clientConnected(1), codec(codec), id(id), addr(addr), flow(flow),
     name(name), credentials(credentials), format(format), shadow(shadow), 
-    playerMutex(mutex), cacheMode(cacheMode) {
+    playerMutex(mutex), cacheMode(cacheMode), pacingBurst(pacingBurst), pacingRate(pacingRate) {
     this->contentLength = (flow && contentLength == HTTP_CL_REAL) ? HTTP_CL_NONE : contentLength;
+    stats = std::make_shared<deviceMetrics>(this->id, this->name);
+    metrics::add(stats);
     
     // Register this player instance in the valid players set
     {
@@ -223,7 +230,7 @@ size_t CSpotPlayer::writePCM(uint8_t* data, size_t bytes, std::string_view track
     if (flushed) return 0;
 #endif
 
-    std::lock_guard lock(playerMutex);
+    std::unique_lock lock(playerMutex);
 
     if (streamTrackUnique != trackUnique) {
         // we can only accept 2 players (UPnP nextURI is one max)
@@ -241,8 +248,33 @@ size_t CSpotPlayer::writePCM(uint8_t* data, size_t bytes, std::string_view track
     if (flushed) return bytes;
 #endif
 
-    if (!streamers.empty() && streamers.front()->feedPCMFrames(data, bytes)) return bytes;
-    else return 0;
+    if (streamers.empty()) return 0;
+    auto streamer = streamers.front();
+    if (streamer->feedPCMFrames(data, bytes)) return bytes;
+
+    /* Streamer is full because clients don't read fast enough, so instead of having cspot 
+     * retrying (and decoding) in a loop, wait for streamer to have room for a decent amount. 
+     * This must be done without player's lock, so re-check everything once we have it again */
+    lock.unlock();
+    if (streamer->waitCredit(bytes, 500)) {
+        lock.lock();
+        if (isRunning && !streamers.empty() && streamers.front() == streamer && 
+            streamer->feedPCMFrames(data, bytes)) return bytes;
+    }
+
+    metrics::inc(stats->pcmRejected);
+    return 0;
+}
+
+void CSpotPlayer::reportAction(int32_t rtt, bool success, int errorCount) {
+    // negative round-trip time means action was not timed
+    metrics::inc(stats->actions);
+    if (!success) metrics::inc(stats->actionErrors);
+    metrics::set(stats->errorCount, (int32_t) errorCount);
+    if (rtt < 0) return;
+    metrics::set(stats->actionRtt, (uint32_t) rtt);
+    metrics::inc(stats->actionRttSum, (uint64_t) rtt);
+    metrics::inc(stats->actionRttCount);
 }
 
 auto CSpotPlayer::postHandler(struct mg_connection* conn) {
@@ -296,7 +328,7 @@ void CSpotPlayer::trackHandler(std::string_view trackUnique) {
     
     // switch current streamer to draining state except in flow mode
     if (!streamers.empty() && !flow) {
-        streamers.front()->state = HTTPstreamer::DRAINING;
+        streamers.front()->drain();
         CSPOT_LOG(info, "draining track %s", streamers.front()->streamId.c_str());
     }
       
@@ -321,9 +353,20 @@ void CSpotPlayer::trackHandler(std::string_view trackUnique) {
             }
         };
 
-        auto streamer = std::make_shared<HTTPstreamer>(addr, id, index++, codec, flow, contentLength, cacheMode, 
-                                                       newTrackInfo, trackUnique, streamers.empty() ? -startOffset : 0,
-                                                       nullptr, eosCallback);
+        // streamers are prepared ahead of time, they only need to be told what they play
+        if (!pool) pool = std::make_shared<streamerPool>([eosCallback, addr = addr, id = id, codec = codec, flow = flow, 
+                                                          contentLength = contentLength, cacheMode = cacheMode,
+                                                          burst = pacingBurst, rate = pacingRate] {
+            auto streamer = std::make_shared<HTTPstreamer>(addr, id, codec, flow, contentLength, cacheMode, nullptr, eosCallback);
+            streamer->setPacing(std::max(burst, 0) * 1000, std::max(rate, 0));
+            return streamer;
+        });
+
+        auto streamer = pool->get();
+        streamer->load(index++, newTrackInfo, trackUnique, streamers.empty() ? -startOffset : 0);
+
+        // source quality changes decoded audio, so it is part of what identifies a stored track
+        streamer->useTrackCache(std::to_string(format));
 
         CSPOT_LOG(info, "loading with id %s", streamer->streamId.c_str());
 
@@ -344,14 +387,15 @@ void CSpotPlayer::trackHandler(std::string_view trackUnique) {
             CSPOT_LOG(info, "[ANALYSIS:DISCRETE_MODE] new_streamer");
         }
        
+        // streamer must be reachable before its url is given to the player
+        streamers.push_front(streamer);
+        streamer->start();
+
         // position is optional, shadow player might use it or not
         shadowRequest(shadow, SPOT_LOAD, streamer->getStreamUrl().c_str(), &metadata, (uint32_t)-streamer->offset);
 
         // play unless already paused
         if (!isPaused) shadowRequest(shadow, SPOT_PLAY);
- 
-        streamers.push_front(streamer);
-        streamer->startTask();
     } else {
         // Flow mode with existing player - subsequent track in flow
         // Check if we've already played this track (loop detection for repeat+shuffle)
@@ -492,7 +536,7 @@ void CSpotPlayer::trackHandler(std::string_view trackUnique) {
     case cspot::SpircHandler::EventType::DEPLETED:
         playlistEnd = true;
         if (!streamers.empty() && streamers.front()) {
-            streamers.front()->state = HTTPstreamer::DRAINING;
+            streamers.front()->drain();
             CSPOT_LOG(info, "playlist ended, no track left to play");
         } else {
             CSPOT_LOG(error, "DEPLETED event but no active streamer (streamers.size=%zu)", streamers.size());
@@ -628,6 +672,7 @@ void CSpotPlayer::disconnect(bool abort) {
 }
 
 bool getMetaForUrl(CSpotPlayer* self, const std::string url, metadata_t* metadata) {
+    // caller holds player's (device) mutex, and metadata point to streamer's strings
     for (auto it = self->streamers.begin(); it != self->streamers.end(); ++it) {
         if ((*it)->getStreamUrl() == url) {
             (*it)->getMetadata(metadata);
@@ -835,12 +880,20 @@ void spotOpen(uint16_t portBase, uint16_t portRange, char *username, char* passw
         // Only unset if not explicitly set externally
         unsetenv("CSPOT_DEBUG_FILES");
     }
-    HTTPstreamer::portBase = portBase;
-    if (portRange) HTTPstreamer::portRange = portRange;
+    HTTPserver::portBase = portBase;
+    if (portRange) HTTPserver::portRange = portRange;
     if (username) CSpotPlayer::username = username;
     if (password) CSpotPlayer::password = password;
 }
 
+void spotSetTrackCache(const char* path, uint32_t sizeMB) {
+    trackCache::open(path ? path : "", (uint64_t) sizeMB * 1024 * 1024);
+}
+
+void spotSetMemoryBudget(uint32_t sizeMB) {
+    if (sizeMB) memoryPool::instance().setBudget((size_t) sizeMB * 1024 * 1024);
+}
+
 void spotSetClientId(const char* clientId) {
     if (clientId && *clientId) {
         CSpotPlayer::customClientId = clientId;
@@ -1009,13 +1062,15 @@ void spotClose(void) {
 
 struct spotPlayer* spotCreatePlayer(char* name, char *id, char * credentials, struct in_addr addr, int oggRate, 
                                         char *codec, bool flow, int64_t contentLength, int CacheMode, 
+                                        int pacingBurst, int pacingRate,
                                         struct shadowPlayer* shadow, pthread_mutex_t *mutex) {
     AudioFormat format = AudioFormat_OGG_VORBIS_160;
 
     if (oggRate == 320) format = AudioFormat_OGG_VORBIS_320;
     else if (oggRate == 96) format = AudioFormat_OGG_VORBIS_96;
 
-    auto player = new CSpotPlayer(name, id, credentials, addr, format, codec, flow, contentLength, CacheMode, shadow, mutex);
+    auto player = new CSpotPlayer(name, id, credentials, addr, format, codec, flow, contentLength, CacheMode, 
+                                  pacingBurst, pacingRate, shadow, mutex);
     if (player->startTask()) return (struct spotPlayer*) player;
 
     delete player;
@@ -1027,11 +1082,19 @@ void spotDeletePlayer(struct spotPlayer* spotPlayer) {
     delete player;
 }
 
+void spotReportAction(struct spotPlayer* spotPlayer, int32_t rtt, bool success, int errorCount) {
+    auto player = (CSpotPlayer*) spotPlayer;
+    if (!player) return;
+    player->reportAction(rtt, success, errorCount);
+}
+
 bool spotGetMetaForUrl(struct spotPlayer* spotPlayer, const char *url, metadata_t *metadata) {
     return getMetaForUrl((CSpotPlayer*)spotPlayer, url, metadata);
  }
 
 void spotNotify(struct spotPlayer* spotPlayer, enum shadowEvent event, ...) {
+    // renderers following another one have no player, their leader speaks for them
+    if (!spotPlayer) return;
     va_list args;
     va_start(args, event);
     notify((CSpotPlayer*)spotPlayer, event, args);
@@ -36,10 +36,14 @@ struct shadowPlayer;
 void				   shadowRequest(struct shadowPlayer* shadow, enum spotEvent event, ...);
 
 struct spotPlayer* spotCreatePlayer(char* name, char* id, char *credentials, struct in_addr addr, int audio, char *codec, bool flow, 
-								    int64_t contentLength, int cacheMode, struct shadowPlayer* shadow, pthread_mutex_t *mutex);
+								    int64_t contentLength, int cacheMode, int pacingBurst, int pacingRate,
+								    struct shadowPlayer* shadow, pthread_mutex_t *mutex);
 void spotDeletePlayer(struct spotPlayer *spotPlayer);
 bool spotGetMetaForUrl(struct spotPlayer* spotPlayer, const char* url, metadata_t* metadata);
+void spotReportAction(struct spotPlayer* spotPlayer, int32_t rtt, bool success, int errorCount);
 void spotOpen(uint16_t portBase, uint16_t portRange, char* username, char *password);
+void spotSetTrackCache(const char* path, uint32_t sizeMB);
+void spotSetMemoryBudget(uint32_t sizeMB);
 void spotSetClientId(const char* clientId);
 bool spotLoadOAuthCredentials(const char* clientId, const char* credentialsPath);
 void spotSetClientSecret(const char* clientSecret);
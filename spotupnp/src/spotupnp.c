@@ -62,6 +62,9 @@ int					glMaxDevices = 32;
 uint16_t			glPortBase, glPortRange;
 char				glInterface[128] = "?";
 char				glCredentialsPath[STR_LEN];
+char				glTrackCachePath[STR_LEN];
+uint32_t			glTrackCacheSize = 1024;
+uint32_t			glMemoryBudget = 256;
 bool				glCredentials;
 char				glClientId[STR_LEN];
 char				glClientSecret[STR_LEN];
@@ -84,9 +87,12 @@ tMRConfig			glMRConfig = {
 							HTTP_CACHE_INFINITE, // CacheMode
 							true,				 // Gapless
 							HTTP_CL_CHUNKED,	 // HTTPContentLength   
+							10,					 // PacingBurst
+							0,					 // PacingRate
 							true,				 // SendMetaData
 							false,				 // SendCoverArt
 							"",					 // artwork
+							"",					 // Follow
 					};
 
 /*----------------------------------------------------------------------------*/
@@ -153,6 +159,8 @@ static char usage[] =
 		   "  -a <port>[:<count>]  set inbound port and range for RTP and HTTP\n"
 		   "  -r 96|160|320        set Spotify vorbis codec rate (160)\n"
 		   "  -J <path>            path to Spotify credentials files\n"
+		   "  -C <path>[:<MB>]     store encoded tracks in <path> for replay, up to <MB> (1024)\n"
+		   "  -M <MB>              memory budget shared by all audio buffers (256)\n"
 		   "  -j  	               store Spotify credentials in XML config file\n"
 		   "  -U <user>            Spotify username\n"
 		   "  -P <password>        Spotify password\n"
@@ -173,7 +181,7 @@ static char usage[] =
 		   "  -d <log>=<level>     set logging level\n"
 	       "                       logs: all|main|util|upnp\n"
 		   "                       level: error|warn|info|debug|sdebug\n"
-		   "  -c mp3[:<rate>]|opus[:<rate>]|vorbis[:rate]|flc[:0..9]|wav|pcm audio format send to player (flac)\n"
+		   "  -c mp3[:<rate>]|opus[:<rate>]|vorbis[:rate]|flc[:0..9][:mt]|wav|pcm audio format send to player (flac)\n"
 
 #if LINUX || FREEBSD
 		   "  -z                   daemonize\n"
@@ -283,7 +291,7 @@ static void *MRThread(void *args) {
 
 		/* Should not request any status update if we are stopped, off or waiting
 		 * for an action to be performed or slave */
-		if (p->Master || (p->SpotState != SPOT_PLAY && p->State == STOPPED) ||
+		if ((p->Master && !*p->Config.Follow) || (p->SpotState != SPOT_PLAY && p->State == STOPPED) ||
 			p->ErrorCount < 0 || p->ErrorCount > MAX_ACTION_ERRORS || p->WaitCookie) goto sleep;
 
 		// do polling as event is broken in many uPNP devices (not synchronously)
@@ -321,38 +329,18 @@ void SetTrackURI(struct sMR* Device, bool Next, const char * StreamUrl, metadata
 		url = strdup(StreamUrl);
 	}
 
-	if (Next) AVTSetNextURI(Device, url, MetaData, Device->ProtocolInfo);
-	else AVTSetURI(Device, url, MetaData, Device->ProtocolInfo);
+	// a follower receives leader's stream, so it must be announced as such
+	char *ProtocolInfo = Device->Master && *Device->Config.Follow ? Device->Master->ProtocolInfo : Device->ProtocolInfo;
+
+	if (Next) AVTSetNextURI(Device, url, MetaData, ProtocolInfo);
+	else AVTSetURI(Device, url, MetaData, ProtocolInfo);
 
 	free(url);
 }
 
 /*----------------------------------------------------------------------------*/
-void shadowRequest(struct shadowPlayer *shadow, enum spotEvent event, ...) {
-	struct sMR *Device = (struct sMR*) shadow;
-	va_list args;
-	va_start(args, event);
-
-	// mutex is recursive so we should not have issue with shadow/notify calls
-	pthread_mutex_lock(&Device->Mutex);
-
-	if (!Device->Running) {
-		pthread_mutex_unlock(&Device->Mutex);
-		return;
-	}
-
+static void _Transport(struct sMR *Device, enum spotEvent event, char *StreamUrl, metadata_t *MetaData) {
 	switch (event) {
-	case SPOT_CREDENTIALS: {
-		char* Credentials = va_arg(args, char*);
-
-		// Store credentials in XML config file if enabled
-		// (zconf file already written by spotify.cpp)
-		if (glCredentials && glAutoSaveConfigFile) {
-			glUpdated = true;
-			strncpy(Device->Config.Credentials, Credentials, sizeof(Device->Config.Credentials) - 1);
-		}
-		break;
-	}
 	case SPOT_STOP:
 		LOG_INFO("[%p]: Stop", Device);
 		if (Device->SpotState != SPOT_STOP) {
@@ -361,13 +349,7 @@ void shadowRequest(struct shadowPlayer *shadow, enum spotEvent event, ...) {
 		}
 		Device->SpotState = SPOT_STOP;
 		break;
-	case SPOT_LOAD: {
-		char* StreamUrl = va_arg(args, char*);
-		metadata_t* MetaData;
-		
-		if (Device->Config.Flow) MetaData = &Device->MetaData;
-		else MetaData = va_arg(args, metadata_t*);
-			
+	case SPOT_LOAD:
 		// reset these counters to avoid false rollover
 		Device->Elapsed = Device->ElapsedAccrued = 0;
 
@@ -381,8 +363,7 @@ void shadowRequest(struct shadowPlayer *shadow, enum spotEvent event, ...) {
 			LOG_INFO("[%p]: Gapped next track %s", Device, Device->NextStreamUrl);
 		}
 		break;
-	}	
-	case SPOT_PLAY: {
+	case SPOT_PLAY:
 		// can't play until we are loaded or paused
 		if (Device->SpotState == SPOT_PLAY) break;
 		LOG_INFO("[%p]: spotify play request", Device);
@@ -391,13 +372,73 @@ void shadowRequest(struct shadowPlayer *shadow, enum spotEvent event, ...) {
 		Device->SpotState = SPOT_PLAY;
 		Device->ExpectStop = false;
 		break;
-	}
 	case SPOT_PAUSE:
 		if (Device->SpotState == SPOT_PAUSE) break;
 		LOG_INFO("[%p]: spotify pause request", Device);
 		if (Device->State != PAUSED || Device->ExpectStop) AVTBasic(Device, "Pause");
 		Device->SpotState = event;
 		break;
+	default:
+		break;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void Transport(struct sMR *Device, enum spotEvent event, char *StreamUrl, metadata_t *MetaData) {
+	_Transport(Device, event, StreamUrl, MetaData);
+
+	/* Followers play the very same stream (one encoder and one cache, each renderer has its 
+	 * own HTTP connection), so they just mirror leader's transport actions */
+	for (int i = 0; i < glMaxDevices; i++) {
+		struct sMR *p = glMRDevices + i;
+		if (!p->Running || p->Master != Device || !*p->Config.Follow) continue;
+		pthread_mutex_lock(&p->Mutex);
+		_Transport(p, event, StreamUrl, MetaData);
+		pthread_mutex_unlock(&p->Mutex);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+void shadowRequest(struct shadowPlayer *shadow, enum spotEvent event, ...) {
+	struct sMR *Device = (struct sMR*) shadow;
+	va_list args;
+	va_start(args, event);
+
+	// mutex is recursive so we should not have issue with shadow/notify calls
+	pthread_mutex_lock(&Device->Mutex);
+
+	if (!Device->Running) {
+		pthread_mutex_unlock(&Device->Mutex);
+		return;
+	}
+
+	switch (event) {
+	case SPOT_CREDENTIALS: {
+		char* Credentials = va_arg(args, char*);
+
+		// Store credentials in XML config file if enabled
+		// (zconf file already written by spotify.cpp)
+		if (glCredentials && glAutoSaveConfigFile) {
+			glUpdated = true;
+			strncpy(Device->Config.Credentials, Credentials, sizeof(Device->Config.Credentials) - 1);
+		}
+		break;
+	}
+	case SPOT_STOP:
+	case SPOT_PLAY:
+	case SPOT_PAUSE:
+		Transport(Device, event, NULL, NULL);
+		break;
+	case SPOT_LOAD: {
+		char* StreamUrl = va_arg(args, char*);
+		metadata_t* MetaData;
+		
+		if (Device->Config.Flow) MetaData = &Device->MetaData;
+		else MetaData = va_arg(args, metadata_t*);
+
+		Transport(Device, event, StreamUrl, MetaData);
+		break;
+	}	
 	case SPOT_VOLUME: {
 		// discard echo commands
 		uint32_t now = gettime_ms();
@@ -463,6 +504,7 @@ static bool _ProcessQueue(struct sMR *Device) {
 	if ((Action = queue_extract(&Device->ActionQueue)) == NULL) return false;
 
 	Device->WaitCookie = Device->seqN++;
+	Device->WaitStamp = gettime_ms();
 	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
 							 NULL, Action->ActionNode, ActionHandler, Device->WaitCookie);
 
@@ -645,6 +687,8 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 				// discard everything else except waiting action
 				if (Cookie != p->WaitCookie) break;
 
+				spotReportAction(p->SpotPlayer, gettime_ms() - p->WaitStamp, 
+								 UpnpActionComplete_get_ErrCode(Event) == UPNP_E_SUCCESS, p->ErrorCount);
 				p->StartCookie = p->WaitCookie;
 				_ProcessQueue(p);
 
@@ -675,12 +719,26 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 
 					if (p->SpotState == SPOT_PLAY && !p->ExpectStop && p->NextStreamUrl) {
 						metadata_t MetaData = { 0 };
-						if (spotGetMetaForUrl(p->SpotPlayer, p->NextStreamUrl, &MetaData)) {
+						struct spotPlayer *Player = p->SpotPlayer;
+						struct sMR *Leader = Player ? NULL : p->Master;
+
+						/* followers play leader's streams, which are guarded by leader's mutex. Take it
+						 * before ours, like Transport() does, and re-check what might have changed */
+						if (Leader) {
+							pthread_mutex_unlock(&p->Mutex);
+							pthread_mutex_lock(&Leader->Mutex);
+							pthread_mutex_lock(&p->Mutex);
+							if (p->Running && p->Master == Leader && p->NextStreamUrl) Player = Leader->SpotPlayer;
+						}
+
+						if (Player && spotGetMetaForUrl(Player, p->NextStreamUrl, &MetaData)) {
 							SetTrackURI(p, false, p->NextStreamUrl, &MetaData);
 							AVTPlay(p);
 						} else {
 							spotNotify(p->SpotPlayer, SHADOW_STOP);
 						}
+
+						if (Leader) pthread_mutex_unlock(&Leader->Mutex);
 						NFREE(p->NextStreamUrl);
 					} else if (p->SpotState != SPOT_STOP && p->SpotState != SPOT_PAUSE) {
 						// some players (Sonos again...) report a STOPPED state when pause *only* with mp3
@@ -762,6 +820,7 @@ int ActionHandler(Upnp_EventType EventType, const void *Event, void *Cookie) {
 				p->ErrorCount = 0;
 			}
 
+			spotReportAction(p->SpotPlayer, -1, UpnpActionComplete_get_ErrCode(Event) == UPNP_E_SUCCESS, p->ErrorCount);
 			break;
 		}
 		default:
@@ -996,6 +1055,7 @@ static void *UpdateThread(void *args) {
 					if (Device->Running && !strcmp(Device->DescDocURL, Update->Data)) {
 						char *friendlyName = NULL;
 						struct sMR *Master = GetMaster(Device, &friendlyName);
+						if (!Master) Master = GetLeader(Device);
 
 						Device->LastSeen = now;
 						LOG_DEBUG("[%p] UPnP keep alive: %s", Device, Device->Config.Name);
@@ -1067,7 +1127,8 @@ static void *UpdateThread(void *args) {
 							
 							Device->SpotPlayer = spotCreatePlayer(Device->Config.Name, Device->deviceId, Device->Credentials, glHost, Device->Config.VorbisRate,
 																  Device->Config.Codec, Device->Config.Flow, Device->Config.HTTPContentLength, 
-																  Device->Config.CacheMode, (struct shadowPlayer*) Device, &Device->Mutex);
+																  Device->Config.CacheMode, Device->Config.PacingBurst, Device->Config.PacingRate,
+																  (struct shadowPlayer*) Device, &Device->Mutex);
 							pthread_mutex_unlock(&Device->Mutex);
 						} else if (Master && (!Device->Master || Device->Master == Device)) {
 							pthread_mutex_lock(&Device->Mutex);
@@ -1133,7 +1194,8 @@ static void *UpdateThread(void *args) {
 				// create a new Spotify Connect device
 				Device->SpotPlayer = spotCreatePlayer(Device->Config.Name, Device->deviceId, Device->Credentials, glHost, Device->Config.VorbisRate,
 													  Device->Config.Codec, Device->Config.Flow, Device->Config.HTTPContentLength, 
-													  Device->Config.CacheMode, (struct shadowPlayer*) Device, &Device->Mutex);
+													  Device->Config.CacheMode, Device->Config.PacingBurst, Device->Config.PacingRate,
+													  (struct shadowPlayer*) Device, &Device->Mutex);
 				if (!Device->SpotPlayer) {
 					LOG_ERROR("[%p]: cannot create Spotify instance (%s)", Device, Device->Config.Name);
 					pthread_mutex_lock(&Device->Mutex);
@@ -1297,6 +1359,7 @@ static bool AddMRDevice(struct sMR* Device, char* UDN, IXML_Document* DescDoc, c
 	}
 
 	Device->Master = GetMaster(Device, &friendlyName);
+	if (!Device->Master) Device->Master = GetLeader(Device);
 
 	// Volume will be loaded after SpotPlayer and deviceId are created
 	Device->Volume = Device->Config.MaxVolume / 10;
@@ -1356,7 +1419,9 @@ static bool AddMRDevice(struct sMR* Device, char* UDN, IXML_Document* DescDoc, c
 		}
 	}
 
-	if (Device->Master) {
+	if (Device->Master && *Device->Config.Follow) {
+		LOG_INFO("[%p] %s follows %s", Device, friendlyName, Device->Master->friendlyName);
+	} else if (Device->Master) {
 		LOG_INFO("[%p] skipping Sonos slave %s", Device, friendlyName);
 	} else {
 		LOG_INFO("[%p]: adding renderer (%s) with mac %hX%X", Device, friendlyName, *(uint16_t*)Device->Config.mac, *(uint32_t*)(Device->Config.mac + 2));
@@ -1446,6 +1511,8 @@ static bool Start(bool cold) {
 
 	// start cspot
 	spotOpen(glPortBase, glPortRange, glUserName, glPassword);
+	if (*glTrackCachePath) spotSetTrackCache(glTrackCachePath, glTrackCacheSize);
+	spotSetMemoryBudget(glMemoryBudget);
 	
 	// Set custom client ID and load OAuth credentials if configured
 	if (*glClientId) {
@@ -1670,7 +1737,7 @@ bool ParseArgs(int argc, char **argv) {
 
 	while (optind < argc && strlen(argv[optind]) >= 2 && argv[optind][0] == '-') {
 		char *opt = argv[optind] + 1;
-		if (strstr("abxdpifmnocugrJUPNA", opt) && optind < argc - 1) {
+		if (strstr("abxdpifmnocugrJUPNACM", opt) && optind < argc - 1) {
 			optarg = argv[optind + 1];
 			optind += 2;
 		} else if (strstr("tzZIklej", opt) || opt[0] == '-') {
@@ -1700,6 +1767,20 @@ bool ParseArgs(int argc, char **argv) {
 		case 'j':
 			glCredentials = true;
 			break;
+		case 'C': {
+			// size is optional and after the last ':' as path might have some (C:\cache)
+			char* size = strrchr(optarg, ':');
+			size_t len = strlen(optarg);
+			if (size && size[1] && strspn(size + 1, "0123456789") == strlen(size + 1)) {
+				glTrackCacheSize = atoi(size + 1);
+				len = size - optarg;
+			}
+			snprintf(glTrackCachePath, sizeof(glTrackCachePath), "%.*s", (int) len, optarg);
+			break;
+		}
+		case 'M':
+			glMemoryBudget = atoi(optarg);
+			break;
 		case 'c':
 			strcpy(glMRConfig.Codec, optarg);
 			break;
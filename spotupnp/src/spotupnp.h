@@ -64,9 +64,12 @@ typedef struct sMRConfig
 	int			CacheMode;
 	bool		Gapless;
 	int64_t		HTTPContentLength;
+	int			PacingBurst;
+	int			PacingRate;
 	bool		SendMetaData;
 	bool		SendCoverArt;
 	char		ArtWork[4*STR_LEN];
+	char		Follow[STR_LEN];	// name or UDN of the renderer whose stream this one plays along
 } tMRConfig;
 
 struct sMR {
@@ -86,6 +89,7 @@ struct sMR {
 	uint32_t		LastSeen;
 	uint8_t			*seqN;
 	void			*WaitCookie, *StartCookie, *LastCookie;
+	uint32_t		WaitStamp;		// when waited action was sent, for round-trip time
 	cross_queue_t	ActionQueue;
 	unsigned		TrackPoll, StatePoll;
 	struct sService Service[NB_SRV];
@@ -114,6 +118,9 @@ extern int					glMaxDevices;
 extern char					glInterface[128];
 extern unsigned short		glPortBase, glPortRange;
 extern char					glCredentialsPath[STR_LEN];
+extern char					glTrackCachePath[STR_LEN];
+extern uint32_t				glTrackCacheSize;
+extern uint32_t				glMemoryBudget;
 extern bool					glCredentials;
 extern char					glClientId[STR_LEN];
 extern char				glClientSecret[STR_LEN];
@@ -0,0 +1,186 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <system_error>
+
+#include "Logger.h"
+
+#include "trackCache.h"
+
+namespace fs = std::filesystem;
+
+/****************************************************************************************
+ * Writer of a track being encoded (it's a temporary file until committed)
+ */
+
+trackCache::writer::~writer(void) {
+    if (file) fclose(file);
+    // committed files have been renamed already
+    if (!path.empty()) remove(path.c_str());
+}
+
+void trackCache::writer::write(const uint8_t* data, size_t size) {
+    if (failed || !size) return;
+    if (headerSize < sizeof(header)) {
+        size_t bytes = std::min(size, sizeof(header) - headerSize);
+        memcpy(header + headerSize, data, bytes);
+        headerSize += bytes;
+    }
+    if (fwrite(data, 1, size, file) != size) failed = true;
+    this->size += size;
+}
+
+void trackCache::writer::patch(fixer fix) {
+    if (failed || !headerSize) return;
+    fix(header, headerSize, size);
+    if (fseek(file, 0, SEEK_SET) || fwrite(header, 1, headerSize, file) != headerSize || fseek(file, 0, SEEK_END)) failed = true;
+}
+
+/****************************************************************************************
+ * Track cache
+ */
+
+trackCache::trackCache(std::string path, uint64_t quota) : path(path), quota(quota) {
+    std::error_code ec;
+    fs::create_directories(path, ec);
+
+    for (auto& item : fs::directory_iterator(path, ec)) {
+        if (!item.is_regular_file(ec)) continue;
+        auto extension = item.path().extension();
+        // leftovers of tracks that were being stored when we stopped
+        if (extension == ".tmp") {
+            fs::remove(item.path(), ec);
+        } else if (extension == ".trk") {
+            entry entry = { item.file_size(ec), item.last_write_time(ec) };
+            entries[item.path().stem().string()] = entry;
+            used += entry.size;
+        }
+    }
+
+    // quota might have been lowered since last run
+    evict(0);
+    CSPOT_LOG(info, "track cache in %s has %zu tracks (%" PRIu64 "/%" PRIu64 " MB)", path.c_str(), entries.size(),
+                     used / (1024 * 1024), quota / (1024 * 1024));
+}
+
+void trackCache::open(std::string path, uint64_t quota) {
+    if (path.empty() || !quota) self.reset();
+    else self.reset(new trackCache(path, quota));
+}
+
+std::string trackCache::key(std::string_view trackId, std::string_view codec, std::string_view source) {
+    // FNV-1a is good enough as we don't expect more than a few thousand files
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto mix = [&hash](std::string_view data) {
+        for (auto c : data) hash = (hash ^ (uint8_t) c) * 0x100000001b3ULL;
+        hash = (hash ^ '|') * 0x100000001b3ULL;
+    };
+    mix(trackId);
+    mix(codec);
+    mix(source);
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016" PRIx64, hash);
+    return key;
+}
+
+void trackCache::evict(uint64_t room) {
+    std::error_code ec;
+    while (used + room > quota && !entries.empty()) {
+        auto oldest = std::min_element(entries.begin(), entries.end(), [](auto& a, auto& b) {
+            return a.second.used < b.second.used;
+        });
+        // on Windows, a file being served can't be removed, so it will be found again at restart
+        fs::remove(fileName(oldest->first), ec);
+        used -= oldest->second.size;
+        CSPOT_LOG(debug, "track cache evicted %s (%" PRIu64 " bytes)", oldest->first.c_str(), oldest->second.size);
+        entries.erase(oldest);
+    }
+}
+
+bool trackCache::lookup(const std::string& key, std::string& file, uint64_t& size) {
+    std::scoped_lock lock(mutex);
+    std::error_code ec;
+    lookups++;
+
+    auto it = entries.find(key);
+    file = fileName(key);
+
+    // file might have been removed behind our back
+    if (it != entries.end() && fs::file_size(file, ec) != it->second.size) {
+        used -= it->second.size;
+        entries.erase(it);
+        it = entries.end();
+    }
+
+    if (it == entries.end()) {
+        CSPOT_LOG(info, "track cache miss for %s (hits %" PRIu64 "/%" PRIu64 ")", key.c_str(), hits.load(), lookups.load());
+        return false;
+    }
+
+    // file time is what survives restarts for LRU
+    it->second.used = fs::file_time_type::clock::now();
+    fs::last_write_time(file, it->second.used, ec);
+
+    size = it->second.size;
+    return true;
+}
+
+void trackCache::served(const std::string& key, uint64_t size) {
+    // only counted once the file could be opened
+    hits++;
+    saved += size;
+    CSPOT_LOG(info, "track cache hit for %s with %" PRIu64 " bytes (hits %" PRIu64 "/%" PRIu64 ", %" PRIu64 " MB saved)",
+                     key.c_str(), size, hits.load(), lookups.load(), saved.load() / (1024 * 1024));
+}
+
+std::unique_ptr<trackCache::writer> trackCache::store(const std::string& key) {
+    // different players might encode the same track at the same time
+    auto tmp = fileName(key) + "." + std::to_string(sequence++) + ".tmp";
+    FILE* file = fopen(tmp.c_str(), "wb");
+
+    if (!file) {
+        CSPOT_LOG(error, "can't create track cache file %s (%s)", tmp.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    return std::make_unique<writer>(key, tmp, file);
+}
+
+bool trackCache::commit(std::unique_ptr<writer> writer) {
+    if (fclose(writer->file)) writer->failed = true;
+    writer->file = NULL;
+
+    // writer's destructor gets rid of the temporary file
+    if (writer->failed || !writer->size || writer->size > quota) return false;
+
+    std::scoped_lock lock(mutex);
+    std::error_code ec;
+
+    auto it = entries.find(writer->key);
+    if (it != entries.end()) {
+        used -= it->second.size;
+        entries.erase(it);
+    }
+
+    evict(writer->size);
+
+    fs::rename(writer->path, fileName(writer->key), ec);
+    if (ec) {
+        CSPOT_LOG(error, "can't store track %s (%s)", writer->key.c_str(), ec.message().c_str());
+        return false;
+    }
+
+    writer->path.clear();
+    entries[writer->key] = { writer->size, fs::file_time_type::clock::now() };
+    used += writer->size;
+
+    CSPOT_LOG(info, "track cache stored %s with %" PRIu64 " bytes (%" PRIu64 "/%" PRIu64 " MB used)", writer->key.c_str(),
+                     writer->size, used / (1024 * 1024), quota / (1024 * 1024));
+    return true;
+}
@@ -0,0 +1,76 @@
+/*
+ *  This software is released under the MIT License.
+ *  https://opensource.org/licenses/MIT
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <filesystem>
+#include <stdio.h>
+#include <inttypes.h>
+
+/****************************************************************************************
+ * Persistent cache of fully encoded tracks. Files are named after a hash of the track id
+ * and of everything that changes the encoded bytes (codec, settings, source quality). It
+ * is kept within a size quota by evicting least recently used files (file time is used
+ * so that it survives restarts). A track is only stored once it has been fully encoded
+ */
+class trackCache {
+public:
+    class writer {
+    private:
+        FILE* file;
+        std::string key, path;
+        uint64_t size = 0;
+        // copy of file's start, where codecs have their header
+        uint8_t header[64];
+        size_t headerSize = 0;
+        bool failed = false;
+        friend class trackCache;
+
+    public:
+        typedef std::function<void(uint8_t* data, size_t size, uint64_t length)> fixer;
+        writer(std::string key, std::string path, FILE* file) : file(file), key(key), path(path) { }
+        ~writer(void);
+        void write(const uint8_t* data, size_t size);
+        // let codec rewrite its header once the file is complete (must be before commit)
+        void patch(fixer fix);
+    };
+
+private:
+    struct entry {
+        uint64_t size;
+        std::filesystem::file_time_type used;
+    };
+
+    std::mutex mutex;
+    std::string path;
+    uint64_t quota, used = 0;
+    std::map<std::string, entry> entries;
+    std::atomic<uint32_t> sequence = 0;
+    inline static std::unique_ptr<trackCache> self;
+
+    trackCache(std::string path, uint64_t quota);
+    std::string fileName(const std::string& key) { return path + "/" + key + ".trk"; }
+    void evict(uint64_t room);
+
+public:
+    std::atomic<uint64_t> lookups = 0, hits = 0, saved = 0;
+
+    static void open(std::string path, uint64_t quota);
+    static trackCache* instance(void) { return self.get(); }
+    static std::string key(std::string_view trackId, std::string_view codec, std::string_view source);
+    bool lookup(const std::string& key, std::string& file, uint64_t& size);
+    // a file found by lookup() is actually served
+    void served(const std::string& key, uint64_t size);
+    std::unique_ptr<writer> store(const std::string& key);
+    bool commit(std::unique_ptr<writer> writer);
+};